@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Check of repeated keys
+   ----------------------
+   Records with few distinct keys are bulk loaded and inserted in a scratch
+   directory with small pages, so that the entries of a key span several
+   leaves and separators repeat in the parents. The children of the nodes of
+   every level have to follow the leaves and right links of the level below.
+   Then every third key is removed without rebalancing, as with
+   rebalanceInterval 0, and the queries must not find any of their entries.
+
+   ./duplicates.out [records] [keys]
+   */
+
+#define BPLUS_NO_MAIN
+#include "../bplus.cpp"
+
+#include <random>
+
+// Return the key and string of every entry in the tree
+vector< pair<double, string> > scanTree() {
+    vector<DBObject> objects;
+    VectorSink sink(objects);
+    windowQuery(-numeric_limits<double>::infinity(), numeric_limits<double>::infinity(), sink);
+
+    vector< pair<double, string> > entries;
+    for (auto &object : objects) {
+        entries.push_back(make_pair(object.getKey(), object.getDataString()));
+    }
+    sort(entries.begin(), entries.end());
+
+    return entries;
+}
+
+// Check that the children of each level, read from left to right, are the
+// nodes of the level below in the order of their links
+bool checkChildOrder() {
+    long fileIndex = rootIndex;
+    while (true) {
+        // Collect the children of the level along the right links
+        vector<long> children;
+        bool leaves = false;
+        for (long index = fileIndex; index != DEFAULT_LOCATION; ) {
+            Node *node = bufferPool->fetch(index);
+            if (node->isLeaf()) {
+                leaves = true;
+            }
+            children.insert(children.end(), node->childIndices.begin(), node->childIndices.end());
+            index = node->rightLinkIndex;
+            bufferPool->release(node);
+        }
+        if (leaves) {
+            return true;
+        }
+
+        // Follow the level below from its first node
+        long position = 0;
+        for (long index = children.front(); index != DEFAULT_LOCATION; ++position) {
+            if (position >= (long) children.size() || children[position] != index) {
+                cout << "Node " << index << " is child " << position << " of no parent" << endl;
+                return false;
+            }
+
+            Node *node = bufferPool->fetch(index);
+            index = node->isLeaf() ? node->nextLeafIndex : node->rightLinkIndex;
+            bufferPool->release(node);
+        }
+        if (position != (long) children.size()) {
+            cout << "The links of a level end before the children above it" << endl;
+            return false;
+        }
+
+        fileIndex = children.front();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long records = argc > 1 ? atol(argv[1]) : 20000;
+    long keyCount = argc > 2 ? atol(argv[2]) : 200;
+
+    // The tree lives in a scratch directory
+    char directory[] = "/tmp/bplus_duplicates_XXXXXX";
+    if (mkdtemp(directory) == nullptr || chdir(directory) != 0) {
+        cout << "Unable to create a scratch directory";
+        return 1;
+    }
+    mkdir("leaves", 0755);
+    mkdir("objects", 0755);
+    ofstream configFile(CONFIG_FILE);
+    configFile << "512" << endl;
+    configFile.close();
+
+    Node::initialize();
+    DBObject::initialize();
+    setRoot(bufferPool->create());
+
+    // Half the records are bulk loaded, leaving leaves which start part way
+    // into the entries of a key, and the rest are inserted
+    mt19937_64 generator(42);
+    uniform_int_distribution<long> distribution(0, keyCount - 1);
+    vector< pair<double, string> > entries;
+    stringstream data;
+    for (long i = 0; i < records; ++i) {
+        double key = (distribution(generator) + 0.5) / keyCount;
+        entries.push_back(make_pair(key, "record" + to_string(i)));
+        if (i < records / 2) {
+            data << key << " " << entries.back().second << "\n";
+        }
+    }
+    bulkLoad(data);
+    for (long i = records / 2; i < records; ++i) {
+        insert(DBObject(entries[i].first, entries[i].second));
+    }
+
+    bool passed = checkChildOrder();
+    if (passed) {
+        cout << "Child order with repeated keys: ok" << endl;
+
+        // Remove every third key, the entries left are the others
+        vector< pair<double, string> > kept;
+        for (long i = 0; i < keyCount; i += 3) {
+            remove((i + 0.5) / keyCount);
+        }
+        for (auto &entry : entries) {
+            if ((long) (entry.first * keyCount) % 3 != 0) {
+                kept.push_back(entry);
+            }
+        }
+        sort(kept.begin(), kept.end());
+
+        passed = scanTree() == kept;
+        for (long i = 0; passed && i < keyCount; i += 3) {
+            vector<DBObject> objects;
+            VectorSink sink(objects);
+            pointQuery((i + 0.5) / keyCount, sink);
+            passed = objects.empty();
+        }
+        if (passed) {
+            cout << "Removes of repeated keys: ok" << endl;
+        } else {
+            cout << "Queries find entries of removed keys" << endl;
+        }
+    }
+
+    delete bufferPool;
+    delete treeFile;
+    delete objectStore;
+    delete writeAheadLog;
+
+    // Clean up the scratch directory
+    remove(TREE_FILE);
+    remove(LOG_FILE);
+    remove(OBJECT_FILE);
+    remove("leaves");
+    remove("objects");
+    remove(CONFIG_FILE);
+    if (chdir("/") == 0) {
+        remove(directory);
+    }
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Microbenchmark of the key search kernels
+   ----------------------------------------
+   For every page size, a set of nodes with as many keys as a full node of
+   that size is searched with random keys. Every kernel has to agree with
+   linearSearch, the time per search is reported in nanoseconds. The layout
+   column is the search unrolled for the page sizes Node::initialize has a
+   PageLayout for, the vlayout column the same with the last steps done by
+   the best vector kernel, which is the one the nodes use.
+   */
+
+#define BPLUS_NO_MAIN
+#include "../bplus.cpp"
+
+#include <random>
+
+#define NODES 1024
+#define SEARCHES 1000000
+
+// Time the searches with a kernel, return the nanoseconds per search
+double timeKernel(SearchKernel kernel, vector< vector<double> > &nodes, vector<double> &needles) {
+    long checksum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (long i = 0; i < SEARCHES; ++i) {
+        vector<double> &node = nodes[i % NODES];
+        checksum += kernel(node.data(), node.size(), needles[i]);
+    }
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    // Keep the searches from being optimized away
+    if (checksum == -1) {
+        cout << checksum;
+    }
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (double) SEARCHES;
+}
+
+// The search of the PageLayout for a page size if there is one, unrolled
+// all the way or finished by a vector kernel
+SearchKernel layoutKernel(long pageSize, bool vector) {
+    if (pageSize == 4096) {
+        typedef PageLayout<double, long, 4096> Layout;
+        return vector ? Layout::selectSearch() : Layout::search;
+    } else if (pageSize == 16384) {
+        typedef PageLayout<double, long, 16384> Layout;
+        return vector ? Layout::selectSearch() : Layout::search;
+    } else if (pageSize == 65536) {
+        typedef PageLayout<double, long, 65536> Layout;
+        return vector ? Layout::selectSearch() : Layout::search;
+    }
+    return nullptr;
+}
+
+int main() {
+    vector< pair<string, SearchKernel> > kernels;
+    kernels.push_back(make_pair("linear", linearSearch<double>));
+    kernels.push_back(make_pair("binary", binarySearch<double>));
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.push_back(make_pair("sse", sseSearch));
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        kernels.push_back(make_pair("avx2", avxSearch));
+    }
+#endif
+
+    mt19937_64 generator(42);
+    uniform_real_distribution<double> distribution(0, 1);
+
+    cout << "PAGE\tKEYS";
+    for (auto &kernel : kernels) {
+        cout << "\t" << kernel.first;
+    }
+    cout << "\tlayout\tvlayout" << endl;
+
+    long pageSizes[] = {2048, 4096, 16384, 65536};
+    for (long pageSize : pageSizes) {
+        // Same computation as Node::initialize for a full node
+        long keys = 2 * floor((pageSize - KEYS_OFFSET - sizeof(long)) / (2 * (sizeof(double) + sizeof(long))));
+
+        vector< vector<double> > nodes(NODES);
+        for (auto &node : nodes) {
+            for (long i = 0; i < keys; ++i) {
+                node.push_back(distribution(generator));
+            }
+            sort(node.begin(), node.end());
+        }
+
+        vector<double> needles(SEARCHES);
+        for (auto &needle : needles) {
+            needle = distribution(generator);
+        }
+
+        // Check the kernels against the original linear search
+        auto pageKernels = kernels;
+        if (layoutKernel(pageSize, false) != nullptr) {
+            pageKernels.push_back(make_pair("layout", layoutKernel(pageSize, false)));
+            pageKernels.push_back(make_pair("vlayout", layoutKernel(pageSize, true)));
+        }
+        for (auto &kernel : pageKernels) {
+            for (long i = 0; i < SEARCHES; i += 97) {
+                vector<double> &node = nodes[i % NODES];
+                if (kernel.second(node.data(), node.size(), needles[i])
+                        != linearSearch<double>(node.data(), node.size(), needles[i])) {
+                    cout << kernel.first << " disagrees with linear search" << endl;
+                    return 1;
+                }
+            }
+        }
+
+        cout << pageSize << "\t" << keys;
+        for (auto &kernel : pageKernels) {
+            cout << "\t" << timeKernel(kernel.second, nodes, needles);
+        }
+        if (layoutKernel(pageSize, false) == nullptr) {
+            cout << "\t-\t-";
+        }
+        cout << endl;
+    }
+
+    return 0;
+}
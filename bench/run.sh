@@ -0,0 +1,67 @@
+#!/bin/sh
+
+# Benchmark sweep
+# ---------------
+# For every distribution, dataset size and page size a workload is generated
+# with workload.out and run through tree.out in timing mode, each in its own
+# scratch directory. One row is printed per run with the throughput of the
+# queries and the 50th and 99th percentile latencies of each type of query in
+# microseconds.
+#
+# The sweep is set with these variables, run from the top of the repository:
+#   DISTRIBUTIONS, RECORDS, PAGES : lists to sweep
+#   QUERIES : queries per run, MIX : weights of the query types
+#   SEED : seed of the generator, OPTIONS : more lines for bplustree.config
+#   TREE : the binary which is run, tree.out unless set
+
+DISTRIBUTIONS=${DISTRIBUTIONS:-"sequential uniform zipfian clustered"}
+RECORDS=${RECORDS:-"100000 1000000"}
+PAGES=${PAGES:-"2048 4096 16384"}
+QUERIES=${QUERIES:-20000}
+MIX=${MIX:-"20,20,20,20,20"}
+SEED=${SEED:-42}
+OPTIONS=${OPTIONS:-}
+TREE=${TREE:-tree.out}
+
+TOP=$(pwd)
+SCRATCH=$(mktemp -d "${TMPDIR:-/tmp}/bplus_bench_XXXXXX") || exit 1
+trap 'rm -rf "$SCRATCH"' EXIT
+
+printf "DIST\tRECORDS\tPAGE\tQPS"
+for query in insert point range knn window; do
+    printf "\t%s p50\t%s p99" "$query" "$query"
+done
+printf "\n"
+
+for distribution in $DISTRIBUTIONS; do
+    for records in $RECORDS; do
+        # The same workload is run at every page size
+        rm -rf "$SCRATCH/workload"
+        mkdir -p "$SCRATCH/workload"
+        (cd "$SCRATCH/workload" && "$TOP/workload.out" "$distribution" "$records" "$QUERIES" "$MIX" "$SEED") || exit 1
+
+        for page in $PAGES; do
+            run="$SCRATCH/run"
+            rm -rf "$run"
+            mkdir -p "$run/leaves" "$run/objects"
+            cp "$SCRATCH/workload/"*.txt "$run"
+            printf "%s\ntiming 1\n%s\n" "$page" "$OPTIONS" > "$run/bplustree.config"
+
+            (cd "$run" && "$TOP/$TREE") > "$SCRATCH/report" || exit 1
+
+            # Pick the percentiles out of the report of tree.out
+            awk -v dist="$distribution" -v records="$records" -v page="$page" '
+                $1 == "Answered" { qps = $(NF - 3) }
+                $1 ~ /^(insert|point|range|knn|window)$/ { p50[$1] = $4; p99[$1] = $6 }
+                END {
+                    printf "%s\t%s\t%s\t%d", dist, records, page, qps
+                    split("insert point range knn window", queries, " ")
+                    for (i = 1; i <= 5; ++i) {
+                        q = queries[i]
+                        printf "\t%s\t%s", (q in p50) ? p50[q] : "-", (q in p99) ? p99[q] : "-"
+                    }
+                    printf "\n"
+                }' "$SCRATCH/report"
+        done
+    done
+done
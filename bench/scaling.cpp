@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Scaling benchmark of concurrent queries
+   ---------------------------------------
+   A tree is bulk loaded with random keys in a scratch directory, then mixes
+   of inserts and point, window and kNN queries are run on 1 to N threads of
+   the same thread pool processQuery uses. The tree keeps the inserts of the
+   earlier runs, after every run the leaves are checked to be in order and to
+   hold every entry. Throughput is reported in queries per second.
+
+   ./scaling.out [records] [queries] [threads]
+   */
+
+#define BPLUS_NO_MAIN
+#include "../bplus.cpp"
+
+#include <random>
+
+#define TASK_SIZE 64
+
+// Count the entries along the leaves, return -1 if they are out of order
+long checkLeaves() {
+    Cursor cursor(-numeric_limits<double>::infinity(), numeric_limits<double>::infinity());
+    long count = 0;
+    double previous = -numeric_limits<double>::infinity();
+    for (cursor.seek(previous); cursor.valid(); cursor.next()) {
+        if (cursor.key() < previous) {
+            return -1;
+        }
+        previous = cursor.key();
+        count++;
+    }
+
+    return count;
+}
+
+// Make queries of which insertShare are inserts, the rest are split evenly
+// between point, window and kNN queries
+vector<Query> makeQueries(long count, double insertShare, mt19937_64 &generator) {
+    uniform_real_distribution<double> distribution(0, 1);
+    vector<Query> queries(count);
+    for (auto &query : queries) {
+        double pick = distribution(generator);
+        query.key = distribution(generator);
+        if (pick < insertShare) {
+            query.type = 0;
+            query.dataString = "scaling";
+        } else if (pick < insertShare + (1 - insertShare) / 3) {
+            query.type = 1;
+        } else if (pick < insertShare + 2 * (1 - insertShare) / 3) {
+            query.type = 4;
+            query.lowerLimit = query.key;
+            query.upperLimit = query.key + 0.0001;
+        } else {
+            query.type = 3;
+            query.k = 10;
+        }
+    }
+
+    return queries;
+}
+
+// Run the queries on a pool of threads, return the seconds taken. The
+// records of the results are read and dropped.
+double runQueries(vector<Query> &queries, long threads) {
+    CallbackSink discard([](DBObject &object) { object.getDataString(); });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    {
+        ThreadPool pool(threads);
+        for (long begin = 0; begin < (long) queries.size(); begin += TASK_SIZE) {
+            long end = min(begin + TASK_SIZE, (long) queries.size());
+            pool.submit([&queries, &discard, begin, end]() {
+                    for (long i = begin; i < end; ++i) {
+                        executeQuery(queries[i], discard);
+                    }
+                    });
+        }
+    }
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    long records = argc > 1 ? atol(argv[1]) : 200000;
+    long queryCount = argc > 2 ? atol(argv[2]) : 200000;
+    long maxThreads = argc > 3 ? atol(argv[3]) : max(1u, thread::hardware_concurrency());
+
+    // The tree lives in a scratch directory
+    char directory[] = "/tmp/bplus_scaling_XXXXXX";
+    if (mkdtemp(directory) == nullptr || chdir(directory) != 0) {
+        cout << "Unable to create a scratch directory";
+        return 1;
+    }
+    mkdir("leaves", 0755);
+    mkdir("objects", 0755);
+    ofstream configFile(CONFIG_FILE);
+    configFile << "2048" << endl;
+    configFile.close();
+
+    Node::initialize();
+    DBObject::initialize();
+    setRoot(bufferPool->create());
+
+    mt19937_64 generator(42);
+    uniform_real_distribution<double> distribution(0, 1);
+    stringstream data;
+    for (long i = 0; i < records; ++i) {
+        data << distribution(generator) << " record" << i << "\n";
+    }
+    bulkLoad(data);
+
+    // Queries run concurrently from here on, for one thread as well so that
+    // every run pays for the latches and the copies readers validate. The
+    // inserts are logged from the first checkpoint on.
+    storeSession();
+    concurrent = true;
+
+    long entries = records;
+    vector< pair<string, double> > mixes;
+    mixes.push_back(make_pair("read-only", 0.0));
+    mixes.push_back(make_pair("read-mostly", 0.1));
+    mixes.push_back(make_pair("write-heavy", 0.5));
+
+    // Double the threads up to the maximum
+    vector<long> threadCounts;
+    for (long threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    cout << "MIX\tTHREADS\tSECONDS\tQUERIES/S\tSPEEDUP" << endl;
+    for (auto &mix : mixes) {
+        double baseline = 0;
+        for (long threads : threadCounts) {
+            vector<Query> queries = makeQueries(queryCount, mix.second, generator);
+            double seconds = runQueries(queries, threads);
+            if (threads == 1) {
+                baseline = seconds;
+            }
+
+            for (auto &query : queries) {
+                entries += query.type == 0;
+            }
+            if (checkLeaves() != entries) {
+                cout << "Leaves do not hold the " << entries << " entries inserted" << endl;
+                return 1;
+            }
+
+            cout << mix.first << "\t" << threads << "\t" << seconds << "\t"
+                << (long) (queryCount / seconds) << "\t" << baseline / seconds << endl;
+        }
+    }
+
+    concurrent = false;
+    delete bufferPool;
+    delete treeFile;
+    delete objectStore;
+    delete writeAheadLog;
+
+    // Clean up the scratch directory
+    remove(TREE_FILE);
+    remove(LOG_FILE);
+    remove(OBJECT_FILE);
+    remove("leaves");
+    remove("objects");
+    remove(CONFIG_FILE);
+    if (chdir("/") == 0) {
+        remove(directory);
+    }
+
+    return 0;
+}
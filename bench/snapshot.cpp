@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Check of snapshots
+   ------------------
+   A tree is bulk loaded with small pages in a scratch directory and a
+   snapshot is opened. Most of the keys are removed and the tree is
+   rebalanced, so that nodes merge and their pages are freed, then keys are
+   inserted till the tree takes pages beyond the free ones. A window scan
+   under the snapshot has to return what the tree held before the removes,
+   and one after it is closed what it holds now. This is done on a single
+   thread, then with the changes made concurrently on a thread of their own.
+
+   ./snapshot.out [records]
+   */
+
+#define BPLUS_NO_MAIN
+#include "../bplus.cpp"
+
+#include <random>
+
+// Return the key and string of every entry in the tree
+vector< pair<double, string> > scanTree() {
+    vector<DBObject> objects;
+    VectorSink sink(objects);
+    windowQuery(-numeric_limits<double>::infinity(), numeric_limits<double>::infinity(), sink);
+
+    vector< pair<double, string> > entries;
+    for (auto &object : objects) {
+        entries.push_back(make_pair(object.getKey(), object.getDataString()));
+    }
+    sort(entries.begin(), entries.end());
+
+    return entries;
+}
+
+// Remove the keys from lowerLimit to upperLimit and rebalance, then insert
+// keys in their place till pages are taken past the end of the tree file
+void changeTree(vector< pair<double, string> > &entries, double lowerLimit, double upperLimit,
+        mt19937_64 &generator) {
+    vector< pair<double, string> > kept;
+    for (auto &entry : entries) {
+        if (entry.first >= lowerLimit && entry.first <= upperLimit) {
+            remove(entry.first);
+        } else {
+            kept.push_back(entry);
+        }
+    }
+    rebalance();
+
+    uniform_real_distribution<double> distribution(lowerLimit, upperLimit);
+    long fileCount = Node::fileCount;
+    long inserted = 0;
+    while (Node::fileCount <= fileCount || !Node::freeFileIndices.empty()) {
+        double key = distribution(generator);
+        string dataString = "inserted" + to_string(inserted++);
+        insert(DBObject(key, dataString));
+        kept.push_back(make_pair(key, dataString));
+    }
+
+    entries = kept;
+    sort(entries.begin(), entries.end());
+}
+
+// Change the tree under a snapshot, on this thread or another one, and
+// check what the snapshot and the tree read. Return false on a mismatch.
+bool checkSnapshot(vector< pair<double, string> > &entries, double lowerLimit, double upperLimit,
+        mt19937_64 &generator, bool threaded) {
+    vector< pair<double, string> > before = entries;
+    {
+        Snapshot snapshot;
+        if (threaded) {
+            thread writer(changeTree, ref(entries), lowerLimit, upperLimit, ref(generator));
+            writer.join();
+        } else {
+            changeTree(entries, lowerLimit, upperLimit, generator);
+        }
+
+        if (scanTree() != before) {
+            cout << "The snapshot does not read the entries as they were when it was taken" << endl;
+            return false;
+        }
+    }
+
+    if (scanTree() != entries) {
+        cout << "The tree does not hold the entries left and inserted" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    long records = argc > 1 ? atol(argv[1]) : 20000;
+
+    // The tree lives in a scratch directory
+    char directory[] = "/tmp/bplus_snapshot_XXXXXX";
+    if (mkdtemp(directory) == nullptr || chdir(directory) != 0) {
+        cout << "Unable to create a scratch directory";
+        return 1;
+    }
+    mkdir("leaves", 0755);
+    mkdir("objects", 0755);
+    ofstream configFile(CONFIG_FILE);
+    configFile << "512" << endl;
+    configFile.close();
+
+    Node::initialize();
+    DBObject::initialize();
+    setRoot(bufferPool->create());
+
+    stringstream data;
+    for (long i = 0; i < records; ++i) {
+        data << (i + 0.5) / records << " record" << i << "\n";
+    }
+    bulkLoad(data);
+    storeSession();
+
+    mt19937_64 generator(42);
+    vector< pair<double, string> > entries = scanTree();
+    bool passed = checkSnapshot(entries, 0.1, 0.9, generator, false);
+    if (passed) {
+        cout << "Snapshot on a single thread: ok" << endl;
+
+        concurrent = true;
+        passed = checkSnapshot(entries, 0.2, 0.8, generator, true);
+        concurrent = false;
+        if (passed) {
+            cout << "Snapshot with a concurrent writer: ok" << endl;
+        }
+    }
+
+    delete bufferPool;
+    delete treeFile;
+    delete objectStore;
+    delete writeAheadLog;
+
+    // Clean up the scratch directory
+    remove(TREE_FILE);
+    remove(LOG_FILE);
+    remove(OBJECT_FILE);
+    remove("leaves");
+    remove("objects");
+    remove(CONFIG_FILE);
+    if (chdir("/") == 0) {
+        remove(directory);
+    }
+
+    return passed ? 0 : 1;
+}
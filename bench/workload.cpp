@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Workload generator
+   ------------------
+   Writes a data file and a query file in the formats tree.out reads, with
+   keys in [0, 1) drawn from one of these distributions:
+
+   sequential : records are evenly spaced and in order, inserts continue
+                past the largest key and reads pick records uniformly
+   uniform    : records, inserts and reads are uniform
+   zipfian    : records are uniform, inserts and reads pick records by a
+                Zipfian distribution of their rank, so that a few are hot
+   clustered  : records, inserts and reads fall around a few centers
+
+   The mix gives the weights of inserts, point, range, kNN and window
+   queries, optionally followed by removes. The same seed gives the same
+   files.
+
+   ./workload.out distribution records queries [mix] [seed]
+   ./workload.out zipfian 100000 10000 10,50,10,10,20 7
+   */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+using namespace std;
+
+#define DATA_FILE "assgn3_bplus_data.txt"
+#define QUERY_FILE "assgn3_bplus_querysample.txt"
+#define DATA_LENGTH 6
+#define CLUSTERS 16
+#define CLUSTER_WIDTH 0.001
+#define ZIPF_THETA 0.99
+#define MAX_RADIUS 0.001
+#define MAX_K 100
+#define MAX_WIDTH 0.0001
+
+// Draws ranks in [0, n) with probability proportional to 1 / (rank + 1)^theta,
+// in constant time once the zeta constants are computed (Gray et al.)
+class ZipfGenerator {
+    private:
+        long n;
+        double theta;
+        double alpha;
+        double zetan;
+        double eta;
+
+    public:
+        ZipfGenerator(long _n, double _theta);
+
+        long next(mt19937_64 &generator);
+};
+
+ZipfGenerator::ZipfGenerator(long _n, double _theta) : n(_n), theta(_theta) {
+    double zeta2 = 0;
+    zetan = 0;
+    for (long i = 1; i <= n; ++i) {
+        zetan += 1 / pow(i, theta);
+        if (i == 2) {
+            zeta2 = zetan;
+        }
+    }
+
+    alpha = 1 / (1 - theta);
+    eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+}
+
+long ZipfGenerator::next(mt19937_64 &generator) {
+    double u = uniform_real_distribution<double>(0, 1)(generator);
+    double uz = u * zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, theta)) {
+        return 1;
+    }
+    return min(n - 1, (long) (n * pow(eta * u - eta + 1, alpha)));
+}
+
+// Keys of records, inserts and reads for a distribution
+class KeyGenerator {
+    private:
+        string distribution;
+        long records;
+        long spacing;                           // Sequential keys to make
+        mt19937_64 &generator;
+        uniform_real_distribution<double> unit;
+        vector<double> centers;                 // Of the clusters
+        vector<double> keys;                    // Of the records
+        ZipfGenerator *zipf;
+        long sequence;                          // Sequential keys made so far
+
+        // A key around one of the centers
+        double clustered();
+
+    public:
+        KeyGenerator(string _distribution, long _records, long queries, mt19937_64 &_generator);
+        ~KeyGenerator() { delete zipf; }
+
+        // Return the key of the next record
+        double record();
+
+        // Return the key of the next insert, or of the next read
+        double insert();
+        double read();
+};
+
+KeyGenerator::KeyGenerator(string _distribution, long _records, long queries, mt19937_64 &_generator)
+    : distribution(_distribution), records(_records), spacing(_records + queries), generator(_generator),
+    unit(0, 1), zipf(nullptr), sequence(0) {
+    if (distribution != "sequential" && distribution != "uniform"
+            && distribution != "zipfian" && distribution != "clustered") {
+        cout << "Unknown distribution " << distribution << endl;
+        exit(1);
+    }
+
+    for (long i = 0; i < CLUSTERS; ++i) {
+        centers.push_back(unit(generator));
+    }
+
+    if (distribution == "zipfian") {
+        zipf = new ZipfGenerator(records, ZIPF_THETA);
+    }
+}
+
+double KeyGenerator::clustered() {
+    normal_distribution<double> spread(0, CLUSTER_WIDTH);
+    double key = centers[generator() % CLUSTERS] + spread(generator);
+    return min(max(key, 0.0), nextafter(1.0, 0.0));
+}
+
+double KeyGenerator::record() {
+    double key;
+    if (distribution == "sequential") {
+        key = (double) (sequence++) / spacing;
+    } else if (distribution == "clustered") {
+        key = clustered();
+    } else {
+        key = unit(generator);
+    }
+
+    keys.push_back(key);
+    return key;
+}
+
+double KeyGenerator::insert() {
+    if (distribution == "sequential") {
+        return (double) (sequence++) / spacing;
+    } else if (distribution == "zipfian") {
+        return read();
+    } else if (distribution == "clustered") {
+        return clustered();
+    }
+    return unit(generator);
+}
+
+double KeyGenerator::read() {
+    if (keys.empty()) {
+        return unit(generator);
+    }
+
+    // Hot ranks are scattered over the records so that they are not all in
+    // the same leaf
+    if (distribution == "zipfian") {
+        long rank = zipf->next(generator);
+        return keys[(rank * 2654435761L) % keys.size()];
+    }
+    return keys[generator() % keys.size()];
+}
+
+// Return a random data string
+string dataString(mt19937_64 &generator) {
+    string data(DATA_LENGTH, 'a');
+    for (auto &letter : data) {
+        letter = 'a' + generator() % 26;
+    }
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        cout << "Usage: " << argv[0] << " distribution records queries [mix] [seed]" << endl;
+        return 1;
+    }
+
+    string distribution = argv[1];
+    long records = atol(argv[2]);
+    long queries = atol(argv[3]);
+    string mix = argc > 4 ? argv[4] : "20,20,20,20,20";
+    long seed = argc > 5 ? atol(argv[5]) : 42;
+
+    // Weights of the query types in the order of their numbers
+    vector<double> weights;
+    stringstream mixStream(mix);
+    string weight;
+    while (getline(mixStream, weight, ',')) {
+        weights.push_back(atof(weight.c_str()));
+    }
+    if (weights.empty() || weights.size() > 6) {
+        cout << "The mix has one to six weights" << endl;
+        return 1;
+    }
+
+    mt19937_64 generator(seed);
+    KeyGenerator keys(distribution, records, queries, generator);
+    ofstream dataFile(DATA_FILE, ios::out | ios::trunc);
+    ofstream queryFile(QUERY_FILE, ios::out | ios::trunc);
+    dataFile.precision(17);
+    queryFile.precision(17);
+
+    for (long i = 0; i < records; ++i) {
+        dataFile << keys.record() << " " << dataString(generator) << "\n";
+    }
+
+    discrete_distribution<long> types(weights.begin(), weights.end());
+    uniform_real_distribution<double> unit(0, 1);
+    for (long i = 0; i < queries; ++i) {
+        long type = types(generator);
+        queryFile << type << " ";
+        if (type == 0) {
+            queryFile << keys.insert() << " " << dataString(generator);
+        } else if (type == 1 || type == 5) {
+            queryFile << keys.read();
+        } else if (type == 2) {
+            queryFile << keys.read() << " " << MAX_RADIUS * unit(generator);
+        } else if (type == 3) {
+            queryFile << keys.read() << " " << generator() % MAX_K + 1;
+        } else {
+            double lowerLimit = keys.read();
+            queryFile << lowerLimit << " " << lowerLimit + MAX_WIDTH * unit(generator);
+        }
+        queryFile << "\n";
+    }
+
+    return 0;
+}
@@ -19,14 +19,15 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
-/* Structure of file
+/* Structure of a page (stored at fileIndex * pageSize in TREE_FILE)
    -----------------
    fileIndex
-   leaf
-   parent
-   nextLeaf
    previousLeaf
+   nextLeaf
+   rightLink (next node on the same level, nextLeaf for leaves)
+   highKey (no key in the node is larger)
    keySize
+   leaf (padded to 8 bytes so that keys and children are aligned)
    key1
    key2
    ...
@@ -36,27 +37,87 @@
    ...
    child (n+1)
    ------------------
+
+   Leaves keep values of up to inlineValueSize bytes after everything else,
+   in a slot of that size per key. The object pointer of such a value has
+   INLINE_VALUE set and the length of the value in its low byte.
+
+   With STRING_KEYS the highKey slot holds the length of the highKey (-1 for
+   infinity) and the length of the prefix shared by all keys, and the keys
+   are stored after the children:
+   -----------------
+   ...
+   leaf
+   child1
+   ...
+   child (n+1) (n for leaves)
+   offset1 (start of each key suffix in the heap)
+   ...
+   offset (n+1) (end of the last suffix)
+   prefix
+   highKey
+   suffix1
+   ...
+   suffixn
+   ------------------
    */
 
 /* Conventions
-   1. Caller ensures the Node is loaded into memory.
-   2. If a function modifies the Node, it saves it back to disk
+   1. Caller ensures the Node is loaded into memory. Nodes do not know their
+      parents, inserts pass down the path of ancestors with the parent last.
+   2. If a function modifies the Node, it commits it to the buffer pool which
+      writes it back to disk on eviction or when the session is stored.
+   3. Nodes are obtained from the buffer pool pinned, and released when done.
+   4. When queries run concurrently, writers hold the latch of a page while
+      they change the node, crabbing down the tree and latching neighbouring
+      leaves left to right. Readers take no latches, they read a page and
+      check that its version did not change meanwhile.
+   5. A split publishes the new node through the right link of the node it
+      split from before the parent learns of it. A reader who finds a key
+      past the highKey of a node moves right.
+   6. Pages are written in place. A page which an open snapshot reads is
+      copied before it is written, readers of the snapshot are sent to the
+      copy.
    */
 
 // Configuration parameters
 #define CONFIG_FILE "./bplustree.config"
-#define SESSION_FILE "./.tree.session"
+#define LOG_FILE "leaves/log"
 
 // Constants
-#define TREE_PREFIX "leaves/leaf_"
+#define TREE_FILE "leaves/tree"
+#define PREALLOCATE_PAGES 1024
+#define DEFAULT_BUFFER_POOL_SIZE 1024
 #define OBJECT_FILE "objects/objectFile"
 #define DEFAULT_LOCATION -1
+#define OBJECT_READ_SIZE 64
+#define DEFAULT_OBJECT_BUFFER_SIZE (1 << 20)
+#define SORT_RUN_PREFIX "objects/sortRun_"
+#define DEFAULT_SORT_RUN_SIZE 1000000
+#define DEFAULT_FILL_FACTOR 0.9
+#define SEARCH_WINDOW 16
+#define MAPPING_SIZE (1L << 36)
+#define DEFAULT_READAHEAD 8
+#define ROOT_LATCH 0
+#define LATCH_CHUNK_SIZE 4096
+#define DEFAULT_LOG_GROUP_SIZE 128
+#define DEFAULT_CHECKPOINT_INTERVAL 50000
+#define DEFAULT_REBALANCE_INTERVAL 1000
+#define TIMING_FILE "timings.json"
+#define QUERY_TYPES 6
+#define HISTOGRAM_PRECISION 7
+#define SPLIT_LEVELS 16
+#define DEFAULT_IO_DEPTH 64
+#define IO_THREADS 4
+#define INLINE_VALUE (1L << 62)
+#define MAX_INLINE_VALUE_SIZE 255
+#define DEFAULT_OUTPUT_BUFFER_SIZE (1 << 16)
 // #define DEBUG_VERBOSE
 // #define DEBUG_NORMAL
 
-// Two modes of running the program, either time it or show output
-#define OUTPUT
-// #define TIME
+// Keys are doubles, or strings or integers when one of these is defined
+// #define STRING_KEYS
+// #define INTEGER_KEYS
 
 #include <chrono>
 #include <iostream>
@@ -65,14 +126,87 @@
 #include <string>
 #include <cstring>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <queue>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <deque>
+#include <sstream>
+#include <pthread.h>
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include <limits>
 #include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+// Pages are read ahead through io_uring when the kernel headers have it.
+// The Makefile checks for them and defines HAVE_IO_URING, compilers which
+// know __has_include check for themselves.
+#if !defined(HAVE_IO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 
 namespace BPlusTree {
+    // Offsets of the fields in the header of a page
+    enum PageOffset {
+        FILE_INDEX_OFFSET = 0,
+        PREVIOUS_LEAF_OFFSET = 8,
+        NEXT_LEAF_OFFSET = 16,
+        RIGHT_LINK_OFFSET = 24,
+        HIGH_KEY_OFFSET = 32,
+        NUM_KEYS_OFFSET = 40,
+        LEAF_OFFSET = 48,
+        KEYS_OFFSET = 56
+    };
+
+#ifdef STRING_KEYS
+    typedef string Key;
+#elif defined(INTEGER_KEYS)
+    typedef long Key;
+#else
+    typedef double Key;
+#endif
+
+    // Options from the configuration file
+    map<string, double> options;
+
+    double getOption(string name, double defaultValue) {
+        auto option = options.find(name);
+        return option == options.end() ? defaultValue : option->second;
+    }
+
+    // Two modes of running the program, either time the queries or show
+    // their results. Set from the timing option.
+    bool timing = false;
+
+    // Print what each query cost and the totals at the end, set from the
+    // counters option
+    bool printCosts = false;
+
+    // Values up to this many bytes are kept in the leaves instead of the
+    // object store, set from the inlineValueSize option
+    long inlineValueSize = 0;
+
     // A generic compare function for pairs of numbers
     template<typename T>
         class compare {
@@ -82,893 +216,4793 @@ namespace BPlusTree {
                 }
         };
 
-    // Database objects
-    class DBObject {
-        private:
-            double key;
-            long fileIndex;
-            string dataString;
-
-        public:
-            static long objectCount;
-
-        public:
-            DBObject(double _key, string _dataString) : key(_key), dataString(_dataString) {
-                fileIndex = objectCount++;
+    // Kernels to find the position of a key in sorted keys. All of them
+    // return the first position whose key is not less than the given key.
+    template<typename T>
+        using KeySearch = long (*)(const T *keys, long size, T key);
+    typedef KeySearch<double> SearchKernel;
 
-                // Open a file and write the string to it
-                ofstream ofile(OBJECT_FILE, ios::app);
-                ofile << dataString << endl;
-                ofile.close();
-            }
+    // Scan the keys one by one
+    template<typename T>
+    long linearSearch(const T *keys, long size, T key) {
+        // If keys are empty, return
+        if (size == 0 || key <= keys[0]) {
+            return 0;
+        }
 
-            DBObject(double _key, long _fileIndex) : key(_key), fileIndex(_fileIndex) {
-                // Open a file and read the dataString
-                ifstream ifile(OBJECT_FILE);
-                for (long i = 0; i < fileIndex + 1; ++i) {
-                    getline(ifile, dataString);
-                }
-                ifile.close();
+        for (long i = 1; i < size; ++i) {
+            if (keys[i -1] < key && key <= keys[i]) {
+                return i;
             }
+        }
 
-            // Return the key of the object
-            double getKey() { return key; }
+        return size;
+    }
 
-            // Return the string
-            string getDataString() { return dataString; }
+    // Halve the range without branches till a window of keys is left. Every
+    // key before base is less than the key and every key after the window
+    // is not.
+    template<typename T>
+    inline const T *narrowSearch(const T *base, long &size, T key, long window) {
+        while (size > window) {
+            long half = size / 2;
+            base = (base[half] < key) ? base + half : base;
+            size -= half;
+        }
+        return base;
+    }
 
-            // Return the fileIndex
-            long getFileIndex() { return fileIndex; }
-    };
+    template<typename T>
+    long binarySearch(const T *keys, long size, T key) {
+        if (size == 0) {
+            return 0;
+        }
 
-    long DBObject::objectCount = 0;
+        const T *base = narrowSearch(keys, size, key, 1);
+        return (base - keys) + (*base < key);
+    }
 
-    class Node {
-        public:
-            static long fileCount;              // Count of all files
-            static long lowerBound;
-            static long upperBound;
-            static long pageSize;
+#if defined(__x86_64__) || defined(__i386__)
+    // Count the keys less than key, two at a time for SSE and four at a
+    // time for AVX
+    __attribute__((target("sse2")))
+    long sseCount(const double *keys, long size, double key) {
+        long count = 0;
+        __m128d needle = _mm_set1_pd(key);
+        long i = 0;
+        for (; i + 2 <= size; i += 2) {
+            __m128d block = _mm_loadu_pd(keys + i);
+            int mask = _mm_movemask_pd(_mm_cmplt_pd(block, needle));
+            count += (mask & 1) + (mask >> 1);
+        }
+        for (; i < size; ++i) {
+            count += (keys[i] < key);
+        }
 
-        private:
-            long fileIndex;                     // Name of file to store contents
-            bool leaf;                          // Type of leaf
+        return count;
+    }
 
-        public:
-            long parentIndex;
-            long nextLeafIndex;
-            long previousLeafIndex;
-            double keyType;                     // Dummy to indicate container base
-            vector<double> keys;
-            vector<long> childIndices;          // FileIndices of the children
-            vector<long> objectPointers;        // To store the object pointers
+    __attribute__((target("avx2,popcnt")))
+    long avxCount(const double *keys, long size, double key) {
+        long count = 0;
+        __m256d needle = _mm256_set1_pd(key);
+        long i = 0;
+        for (; i + 4 <= size; i += 4) {
+            __m256d block = _mm256_loadu_pd(keys + i);
+            count += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(block, needle, _CMP_LT_OQ)));
+        }
+        for (; i < size; ++i) {
+            count += (keys[i] < key);
+        }
 
-        public:
-            // Basic initialization
-            Node();
+        return count;
+    }
 
-            // Given a fileIndex, read it
-            Node(long _fileIndex);
+    // Narrow down to a window and count the keys less than key in it, the
+    // window is halved for SSE since it compares two keys at a time
+    __attribute__((target("sse2")))
+    long sseSearch(const double *keys, long size, double key) {
+        const double *base = narrowSearch(keys, size, key, SEARCH_WINDOW / 2);
+        return (base - keys) + sseCount(base, size, key);
+    }
 
-            // Check if leaf
-            bool isLeaf() { return leaf; }
+    __attribute__((target("avx2,popcnt")))
+    long avxSearch(const double *keys, long size, double key) {
+        const double *base = narrowSearch(keys, size, key, SEARCH_WINDOW);
+        return (base - keys) + avxCount(base, size, key);
+    }
+#endif
 
-            // Get the file name
-            string getFileName() { return TREE_PREFIX + to_string(fileIndex); }
+    // Pick the best kernel the processor supports
+    SearchKernel selectSearchKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+            return avxSearch;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return sseSearch;
+        }
+#endif
+        return binarySearch<double>;
+    }
 
-            // Get the fileIndex
-            long getFileIndex() { return fileIndex; }
+    // One step of a binary search unrolled at compile time, the position
+    // moves past the next step keys if the last of them is less than key.
+    // The steps stop after the one of Window keys, the position is then at
+    // most Window - 1 keys short.
+    template<typename T, long Step, long Window = 1>
+        struct SearchStep {
+            static long search(const T *keys, long size, T key, long position) {
+                position += (position + Step <= size && keys[position + Step - 1] < key) ? Step : 0;
+                return SearchStep<T, (Step / 2 >= Window ? Step / 2 : 0), Window>::search(keys, size, key, position);
+            }
+        };
 
-            // set to internalNode
-            void setToInternalNode() { leaf = false; }
+    template<typename T, long Window>
+        struct SearchStep<T, 0, Window> {
+            static long search(const T *keys, long size, T key, long position) { return position; }
+        };
 
-            // Return the size of keys
-            long size() { return keys.size(); }
+    // Largest power of two not above n
+    constexpr long powerOfTwoBelow(long n, long power = 1) {
+        return 2 * power > n ? power : powerOfTwoBelow(n, 2 * power);
+    }
 
-            // Initialize the for the tree
-            static void initialize();
+    // Layout of a page of PageSize bytes holding keys of type T and
+    // pointers of type Value. The bounds are the ones Node::initialize
+    // computes at runtime, known here at compile time so that a node is
+    // searched in a fixed number of unrolled steps.
+    template<typename T, typename Value, long PageSize>
+        struct PageLayout {
+            static constexpr long pageSize = PageSize;
+            static constexpr long lowerBound = (PageSize - KEYS_OFFSET - sizeof(Value)) / (2 * (sizeof(T) + sizeof(Value)));
+            static constexpr long upperBound = 2 * lowerBound;
+
+            // A node holds one key more than upperBound before it is split
+            static constexpr long firstStep = powerOfTwoBelow(upperBound + 1);
+
+            static long search(const T *keys, long size, T key) {
+                return SearchStep<T, firstStep>::search(keys, size, key, 0);
+            }
 
-            // Return the position of a key in keys
-            long getKeyPosition(double key);
+            // Return the search the nodes of the layout use, the unrolled
+            // steps are finished by a vector kernel if there is one
+            static KeySearch<T> selectSearch();
+        };
 
-            // Commit node to disk
-            void commitToDisk();
+    // Search of a layout whose last steps are done by a vector kernel
+    template<typename Layout, typename T>
+        struct LayoutSearch {
+            static KeySearch<T> select() { return Layout::search; }
+        };
 
-            // Read from the disk into memory
-            void readFromDisk();
+    template<typename Layout>
+        struct LayoutSearch<Layout, double> {
+#if defined(__x86_64__) || defined(__i386__)
+            // The unrolled steps stop at a window which the kernel counts
+            __attribute__((target("sse2")))
+            static long sseSearch(const double *keys, long size, double key) {
+                long position = SearchStep<double, Layout::firstStep, SEARCH_WINDOW / 2>::search(keys, size, key, 0);
+                return position + sseCount(keys + position, min(size - position, SEARCH_WINDOW / 2L), key);
+            }
 
-            // Print node information
-            void printNode();
+            __attribute__((target("avx2,popcnt")))
+            static long avxSearch(const double *keys, long size, double key) {
+                long position = SearchStep<double, Layout::firstStep, SEARCH_WINDOW>::search(keys, size, key, 0);
+                return position + avxCount(keys + position, min(size - position, (long) SEARCH_WINDOW), key);
+            }
+#endif
 
-            // Serialize the subtree
-            void serialize();
+            // Pick the best kernel the processor supports, as
+            // selectSearchKernel does
+            static KeySearch<double> select() {
+#if defined(__x86_64__) || defined(__i386__)
+                if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+                    return avxSearch;
+                }
+                if (__builtin_cpu_supports("sse2")) {
+                    return sseSearch;
+                }
+#endif
+                return Layout::search;
+            }
+        };
 
-            // Insert object into disk
-            void insertObject(DBObject object);
+    template<typename T, typename Value, long PageSize>
+    KeySearch<T> PageLayout<T, Value, PageSize>::selectSearch() {
+        return LayoutSearch<PageLayout, T>::select();
+    }
 
-            // Insert an internal node into the tree
-            void insertNode(double key, long leftChildIndex, long rightChildIndex);
+    // How keys are laid out in a page and how much room they take. The space
+    // of a node is counted in keys for fixed size keys and in bytes for
+    // variable size ones, Node::capacity is the space a page has.
+    template<typename T>
+        struct KeyFormat;
 
-            // Split the current Leaf Node
-            void splitLeaf();
+    // Numbers are stored one after the other, followed by the pointers
+    template<typename T>
+        struct FixedKeyFormat {
+            static const bool fixedSize = true;
+            static KeySearch<T> kernel;         // Search of the keys of a node
 
-            // Split the current internal Node
-            void splitInternal();
-    };
+            // Larger and smaller than any key
+            static T infinity() {
+                return numeric_limits<T>::has_infinity ? numeric_limits<T>::infinity() : numeric_limits<T>::max();
+            }
+            static T lowest() {
+                return numeric_limits<T>::has_infinity ? -numeric_limits<T>::infinity() : numeric_limits<T>::lowest();
+            }
 
-    // Initialize static variables
-    long Node::lowerBound = 0;
-    long Node::upperBound = 0;
-    long Node::pageSize = 0;
-    long Node::fileCount = 0;
+            // Every key can be stored, the keys are searched with the best
+            // kernel for any page size till Node::initialize picks one for
+            // its page size. Values are counted by Node::leafCapacity.
+            static void initialize(long pageSize, long valueSize) { kernel = defaultKernel(); }
+            static KeySearch<T> defaultKernel();
+            static bool validate(T key) { return true; }
+
+            // Nearest keys not below and not above a value, integers are
+            // rounded inwards
+            static T above(double value) { return numeric_limits<T>::is_integer ? ceil(value) : value; }
+            static T below(double value) { return numeric_limits<T>::is_integer ? floor(value) : value; }
+
+            // Most space a highKey takes, numbers are counted as keys
+            static long highKeySpace() { return 0; }
+
+            // Space taken by the keys of a node, and at most once another
+            // key is added
+            static long space(const vector<T> &keys, T highKey, bool leaf) { return keys.size(); }
+            static long spaceWithRoom(const vector<T> &keys, T highKey, bool leaf) { return keys.size() + 1; }
+
+            // Where a node is split in two, leaves split before the position
+            // and internal nodes move up the key at the position
+            static long splitPosition(const vector<T> &keys, T highKey, bool leaf) { return keys.size() / 2; }
+
+            // Separator between the last key of a leaf and the first key of
+            // the next one
+            static T separator(T last, T first) { return first; }
+
+            // Return the position of a key in sorted keys
+            static long search(const vector<T> &keys, T key) { return kernel(keys.data(), keys.size(), key); }
+
+            // Write the highKey, keys and pointers of a node into its page
+            static void write(char *page, const vector<T> &keys, const vector<long> &pointers, T highKey);
+
+            // Read them back from a page with count keys
+            static void read(const char *page, long count, bool leaf, vector<T> &keys,
+                    vector<long> &pointers, T &highKey);
+
+            // Find the keys and pointers of a page with count keys, and
+            // access them in place
+            static void locate(const char *page, long count, const char *&keyData, const long *&pointers) {
+                keyData = page + KEYS_OFFSET;
+                pointers = (const long *) (keyData + count * sizeof(T));
+            }
+            static T key(const char *page, const char *keyData, long count, long i) {
+                return ((const T *) keyData)[i];
+            }
+            static T highKey(const char *page, const char *keyData, long count) {
+                return *(const T *) (page + HIGH_KEY_OFFSET);
+            }
+            static long searchPage(const char *page, const char *keyData, long count, T key) {
+                return kernel((const T *) keyData, count, key);
+            }
 
-    Node *bRoot = nullptr;
+            // Bytes of the page in use
+            static long usedSize(const char *page, const char *keyData, long count) {
+                return KEYS_OFFSET + count * sizeof(T) + (count + 1) * sizeof(long);
+            }
 
-    Node::Node() {
-        // Initially all the fileNames are DEFAULT_LOCATION
-        parentIndex = DEFAULT_LOCATION;
-        nextLeafIndex = DEFAULT_LOCATION;
-        previousLeafIndex = DEFAULT_LOCATION;
+            // Append a key to a log record, and read it back returning the
+            // bytes it took
+            static void encode(T key, string &out) { out.append((const char *) &key, sizeof(key)); }
+            static long decode(const char *data, T &key) {
+                memcpy((char *) &key, data, sizeof(key));
+                return sizeof(key);
+            }
+        };
 
-        // Initially every node is a leaf
-        leaf = true;
+    template<typename T>
+        KeySearch<T> FixedKeyFormat<T>::kernel = binarySearch<T>;
 
-        // Exit if the lowerBoundKey is not defined
-        if (lowerBound == 0) {
-            cout << "LowerKeyBound not defined";
-            exit(1);
-        }
+    // Doubles have SIMD kernels, integers are searched in halves
+    template<>
+        KeySearch<double> FixedKeyFormat<double>::defaultKernel() { return selectSearchKernel(); }
+    template<>
+        KeySearch<long> FixedKeyFormat<long>::defaultKernel() { return binarySearch<long>; }
 
-        // LeafNode properties
-        fileIndex = ++fileCount;
-    }
+    template<typename T>
+    void FixedKeyFormat<T>::write(char *page, const vector<T> &keys, const vector<long> &pointers, T highKey) {
+        // Add the high key
+        memcpy(page + HIGH_KEY_OFFSET, &highKey, sizeof(highKey));
+        long location = KEYS_OFFSET;
 
-    Node::Node(long _fileIndex) {
-        // Exit if the lowerBoundKey is not defined
-        if (lowerBound == 0) {
-            cout << "LowerKeyBound not defined";
-            exit(1);
-        }
+        // Add the keys to memory
+        memcpy(page + location, keys.data(), keys.size() * sizeof(T));
+        location += keys.size() * sizeof(T);
 
-        // Load the current node from disk
-        fileIndex = _fileIndex;
-        readFromDisk();
+        // Add the child or object pointers to memory
+        memcpy(page + location, pointers.data(), pointers.size() * sizeof(long));
     }
 
-    void Node::initialize() {
-        // Read in the pageSize from the configuration file
-        ifstream configFile;
-        configFile.open(CONFIG_FILE);
-        configFile >> pageSize;
+    template<typename T>
+    void FixedKeyFormat<T>::read(const char *page, long count, bool leaf, vector<T> &keys,
+            vector<long> &pointers, T &highKey) {
+        // Retrieve the highKey
+        memcpy((char *) &highKey, page + HIGH_KEY_OFFSET, sizeof(highKey));
+        long location = KEYS_OFFSET;
 
-        // Save some place in the file for the header
-        long headerSize = sizeof(fileIndex)
-            + sizeof(leaf)
-            + sizeof(parentIndex)
-            + sizeof(nextLeafIndex)
-            + sizeof(previousLeafIndex);
-        pageSize = pageSize - headerSize;
+        // Retrieve the keys
+        const T *keyData = (const T *) (page + location);
+        keys.assign(keyData, keyData + count);
+        location += count * sizeof(T);
 
-        // Compute parameters
-        long nodeSize = sizeof(fileIndex);
-        long keySize = sizeof(keyType);
-        lowerBound = floor((pageSize - nodeSize) / (2 * (keySize + nodeSize)));
-        upperBound = 2 * lowerBound;
-        pageSize = pageSize + headerSize;
+        // Retrieve the pointers, internal nodes have one more than keys
+        const long *pointerData = (const long *) (page + location);
+        pointers.assign(pointerData, pointerData + (leaf ? count : count + 1));
     }
 
-    long Node::getKeyPosition(double key) {
-        // If keys are empty, return
-        if (keys.size() == 0 || key <= keys.front()) {
-            return 0;
-        }
+    template<>
+        struct KeyFormat<double> : FixedKeyFormat<double> {};
+
+    template<>
+        struct KeyFormat<long> : FixedKeyFormat<long> {};
+
+    // Strings are prefix compressed, the prefix shared by the first and the
+    // last key is shared by all the keys of a node and is stored once. After
+    // the pointers a page holds the offsets at which the rest of each key
+    // starts, one more for the end, then the prefix, the highKey and the
+    // rests of the keys. The highKey field of the header holds the length of
+    // the highKey, -1 for infinity, and the length of the prefix.
+    template<>
+        struct KeyFormat<string> {
+            static const bool fixedSize = false;
+            static long pageSize;
+            static long maxLength;              // Longest key which is stored
+            static long valueSize;              // Slot of a value in a leaf
+
+            // Larger than any key which is stored, and smaller than any key
+            static string infinity() { return string(maxLength + 1, '\xff'); }
+            static string lowest() { return string(); }
+
+            // A key with its pointer, offset and value takes at most an
+            // eighth of a page, so that both halves of a split node fit in a
+            // page
+            static void initialize(long _pageSize, long _valueSize) {
+                pageSize = _pageSize;
+                valueSize = _valueSize;
+                maxLength = (pageSize - KEYS_OFFSET) / 8 - sizeof(long) - sizeof(int) - valueSize;
+            }
 
-        for (long i = 1; i < (long)keys.size(); ++i) {
-            if (keys[i -1] < key && key <= keys[i]) {
+            // Check if a key can be stored, a key which cannot is reported
+            // and its record is skipped
+            static bool validate(const string &key) {
+                if ((long) key.size() > maxLength) {
+                    cerr << "Skipping key " << key << ", it is longer than " << maxLength << " bytes" << endl;
+                    return false;
+                }
+                return true;
+            }
+
+            static long highKeySpace() { return maxLength; }
+
+            // Return the length of the prefix shared by two keys
+            static long commonPrefix(const string &first, const string &second) {
+                long length = min(first.size(), second.size());
+                long i = 0;
+                while (i < length && first[i] == second[i]) {
+                    ++i;
+                }
                 return i;
             }
-        }
 
-        return keys.size();
-    }
+            // Bytes of the highKey in the page, infinity takes none
+            static long highKeySize(const string &highKey) {
+                return (long) highKey.size() > maxLength ? 0 : highKey.size();
+            }
 
-    void Node::commitToDisk() {
-        // Create a character buffer which will be written to disk
-        long location = 0;
-        char buffer[pageSize];
+            // Bytes a page needs for count keys of keyBytes in total which
+            // share prefix bytes, with the values of a leaf
+            static long space(long count, long keyBytes, long prefix, long highKeyBytes, bool leaf) {
+                return (leaf ? count : count + 1) * sizeof(long) + (count + 1) * sizeof(int)
+                    + keyBytes - (count - 1) * prefix + highKeyBytes + (leaf ? count * valueSize : 0);
+            }
 
-        // Store the fileIndex
-        memcpy(buffer + location, &fileIndex, sizeof(fileIndex));
-        location += sizeof(fileIndex);
+            static long space(const vector<string> &keys, const string &highKey, bool leaf) {
+                long keyBytes = 0;
+                for (auto &key : keys) {
+                    keyBytes += key.size();
+                }
+                long prefix = keys.empty() ? 0 : commonPrefix(keys.front(), keys.back());
+                return space(keys.size(), keyBytes, prefix, highKeySize(highKey), leaf);
+            }
 
-        // Add the leaf to memory
-        memcpy(buffer + location, &leaf, sizeof(leaf));
-        location += sizeof(leaf);
+            // A key which is added can be of any length, and leave no prefix
+            // for the keys to share
+            static long spaceWithRoom(const vector<string> &keys, const string &highKey, bool leaf) {
+                long keyBytes = maxLength;
+                for (auto &key : keys) {
+                    keyBytes += key.size();
+                }
+                return space(keys.size() + 1, keyBytes, 0, highKeySize(highKey), leaf);
+            }
 
-        // Add parent to memory
-        memcpy(buffer + location, &parentIndex, sizeof(parentIndex));
-        location += sizeof(parentIndex);
+            // Split where the larger half takes the least space, a key added
+            // at either end may leave the rest of the keys with a long prefix
+            static long splitPosition(const vector<string> &keys, const string &highKey, bool leaf);
 
-        // Add the previous leaf node
-        memcpy(buffer + location, &previousLeafIndex, sizeof(nextLeafIndex));
-        location += sizeof(nextLeafIndex);
+            // The shortest prefix of first which is larger than last
+            static string separator(const string &last, const string &first) {
+                return first.substr(0, min(commonPrefix(last, first) + 1, (long) first.size()));
+            }
 
-        // Add the next leaf node
-        memcpy(buffer + location, &nextLeafIndex, sizeof(nextLeafIndex));
-        location += sizeof(nextLeafIndex);
+            static long search(const vector<string> &keys, const string &key) {
+                return lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+            }
 
-        // Store the number of keys
-        long numKeys = keys.size();
-        memcpy(buffer + location, &numKeys, sizeof(numKeys));
-        location += sizeof(numKeys);
+            static void write(char *page, const vector<string> &keys, const vector<long> &pointers, const string &highKey);
+            static void read(const char *page, long count, bool leaf, vector<string> &keys,
+                    vector<long> &pointers, string &highKey);
 
-        // Add the keys to memory
-        for (auto key : keys) {
-            memcpy(buffer + location, &key, sizeof(key));
-            location += sizeof(key);
-        }
+            // A reader may look at a page while it is being written, offsets
+            // and lengths are kept within the page till the reader validates it
+            static void locate(const char *page, long count, const char *&keyData, const long *&pointers) {
+                bool leaf = *(const bool *) (page + LEAF_OFFSET);
+                pointers = (const long *) (page + KEYS_OFFSET);
+                keyData = (const char *) (pointers + (leaf ? count : count + 1));
+            }
+            static string key(const char *page, const char *keyData, long count, long i);
+            static string highKey(const char *page, const char *keyData, long count);
+            static long searchPage(const char *page, const char *keyData, long count, const string &key);
+            static long usedSize(const char *page, const char *keyData, long count) {
+                return offset(keyData, count, heapStart(page, keyData, count));
+            }
 
-        // Add the child pointers to memory
-        if (!leaf) {
-            for (auto childIndex : childIndices) {
-                memcpy(buffer + location, &childIndex, sizeof(childIndex));
-                location += sizeof(childIndex);
+            static void encode(const string &key, string &out) {
+                long length = key.size();
+                out.append((const char *) &length, sizeof(length));
+                out.append(key);
             }
-        } else {
-            for (auto objectPointer : objectPointers) {
-                memcpy(buffer + location, &objectPointer, sizeof(objectPointer));
-                location += sizeof(objectPointer);
+            static long decode(const char *data, string &key) {
+                long length;
+                memcpy((char *) &length, data, sizeof(length));
+                key.assign(data + sizeof(length), length);
+                return sizeof(length) + length;
             }
-        }
 
-        // Create a binary file and write to memory
-        ofstream nodeFile;
-        nodeFile.open(getFileName(), ios::binary|ios::out);
-        nodeFile.write(buffer, pageSize);
-        nodeFile.close();
-    }
+            // Where the prefix starts, after the offsets
+            static long heapStart(const char *page, const char *keyData, long count) {
+                return keyData - page + (count + 1) * sizeof(int);
+            }
 
-    void Node::readFromDisk() {
-        // Create a character buffer which will be written to disk
-        long location = 0;
-        char buffer[pageSize];
+            // Read an offset, or the length of the prefix
+            static long offset(const char *keyData, long i, long start) {
+                int value;
+                memcpy((char *) &value, keyData + i * sizeof(int), sizeof(value));
+                return min(max((long) value, start), pageSize);
+            }
+            static long prefixLength(const char *page, long start) {
+                int value;
+                memcpy((char *) &value, page + HIGH_KEY_OFFSET + sizeof(int), sizeof(value));
+                return min(max((long) value, 0L), pageSize - start);
+            }
 
-        // Open the binary file ane read into memory
-        ifstream nodeFile;
-        nodeFile.open(getFileName(), ios::binary|ios::in);
-        nodeFile.read(buffer, pageSize);
-        nodeFile.close();
+            // Compare two byte strings as string does
+            static int compareBytes(const char *first, long firstLength, const char *second, long secondLength) {
+                int order = memcmp(first, second, min(firstLength, secondLength));
+                return order != 0 ? order : (firstLength > secondLength) - (firstLength < secondLength);
+            }
+        };
 
-        // Retrieve the fileIndex
-        memcpy((char *) &fileIndex, buffer + location, sizeof(fileIndex));
-        location += sizeof(fileIndex);
+    long KeyFormat<string>::pageSize = 0;
+    long KeyFormat<string>::maxLength = 0;
+    long KeyFormat<string>::valueSize = 0;
 
-        // Retreive the type of node
-        memcpy((char *) &leaf, buffer + location, sizeof(leaf));
-        location += sizeof(leaf);
+    long KeyFormat<string>::splitPosition(const vector<string> &keys, const string &highKey, bool leaf) {
+        long count = keys.size();
 
-        // Retrieve the parentIndex
-        memcpy((char *) &parentIndex, buffer + location, sizeof(parentIndex));
-        location += sizeof(parentIndex);
+        // Bytes of the keys before each position
+        vector<long> keyBytes(count + 1, 0);
+        for (long i = 0; i < count; ++i) {
+            keyBytes[i + 1] = keyBytes[i] + keys[i].size();
+        }
 
-        // Retrieve the previousLeafIndex
-        memcpy((char *) &previousLeafIndex, buffer + location, sizeof(previousLeafIndex));
-        location += sizeof(previousLeafIndex);
+        long best = count / 2;
+        long bestSpace = numeric_limits<long>::max();
+        for (long position = leaf ? 1 : 0; position < count; ++position) {
+            // The left half gets a new highKey, the right one keeps the
+            // highKey of the node
+            long rightBegin = leaf ? position : position + 1;
+            long leftPrefix = position > 0 ? commonPrefix(keys.front(), keys[position - 1]) : 0;
+            long rightPrefix = rightBegin < count ? commonPrefix(keys[rightBegin], keys.back()) : 0;
+            long leftHighKeyBytes = leaf
+                ? min(commonPrefix(keys[position - 1], keys[position]) + 1, (long) keys[position].size())
+                : keys[position].size();
+
+            long larger = max(space(position, keyBytes[position], leftPrefix, leftHighKeyBytes, leaf),
+                    space(count - rightBegin, keyBytes[count] - keyBytes[rightBegin], rightPrefix,
+                        highKeySize(highKey), leaf));
+
+            // Prefer the middle among equals
+            if (larger < bestSpace || (larger == bestSpace && labs(position - count / 2) < labs(best - count / 2))) {
+                best = position;
+                bestSpace = larger;
+            }
+        }
 
-        // Retrieve the nextLeafIndex
-        memcpy((char *) &nextLeafIndex, buffer + location, sizeof(nextLeafIndex));
-        location += sizeof(nextLeafIndex);
+        return best;
+    }
 
-        // Retrieve the number of keys
-        long numKeys;
-        memcpy((char *) &numKeys, buffer + location, sizeof(numKeys));
-        location += sizeof(numKeys);
+    void KeyFormat<string>::write(char *page, const vector<string> &keys, const vector<long> &pointers, const string &highKey) {
+        long count = keys.size();
+        if (KEYS_OFFSET + space(keys, highKey, (long) pointers.size() == count) > pageSize) {
+            cout << "Node does not fit in a page";
+            exit(1);
+        }
 
-        // Retrieve the keys
-        keys.clear();
-        double key;
-        for (long i = 0; i < numKeys; ++i) {
-            memcpy((char *) &key, buffer + location, sizeof(key));
-            location += sizeof(key);
-            keys.push_back(key);
+        // Add the lengths of the highKey and prefix
+        long prefix = keys.empty() ? 0 : commonPrefix(keys.front(), keys.back());
+        int highKeyLength = (long) highKey.size() > maxLength ? -1 : highKey.size();
+        int prefixLength = prefix;
+        memcpy(page + HIGH_KEY_OFFSET, &highKeyLength, sizeof(highKeyLength));
+        memcpy(page + HIGH_KEY_OFFSET + sizeof(highKeyLength), &prefixLength, sizeof(prefixLength));
+
+        // Add the child or object pointers
+        long location = KEYS_OFFSET;
+        memcpy(page + location, pointers.data(), pointers.size() * sizeof(long));
+        location += pointers.size() * sizeof(long);
+
+        // Leave room for the offsets, then add the prefix and highKey
+        char *offsets = page + location;
+        location += (count + 1) * sizeof(int);
+        if (count > 0) {
+            memcpy(page + location, keys.front().data(), prefix);
+            location += prefix;
+        }
+        if (highKeyLength > 0) {
+            memcpy(page + location, highKey.data(), highKeyLength);
+            location += highKeyLength;
         }
 
-        // Retrieve childPointers
-        if (!leaf) {
-            childIndices.clear();
-            long childIndex;
-            for (long i = 0; i < numKeys + 1; ++i) {
-                memcpy((char *) &childIndex, buffer + location, sizeof(childIndex));
-                location += sizeof(childIndex);
-                childIndices.push_back(childIndex);
+        // Add the rest of every key after the prefix
+        for (long i = 0; i <= count; ++i) {
+            int offset = location;
+            memcpy(offsets + i * sizeof(int), &offset, sizeof(offset));
+            if (i < count) {
+                memcpy(page + location, keys[i].data() + prefix, keys[i].size() - prefix);
+                location += keys[i].size() - prefix;
+            }
+        }
+    }
+
+    void KeyFormat<string>::read(const char *page, long count, bool leaf, vector<string> &keys,
+            vector<long> &pointers, string &highKey) {
+        const char *keyData;
+        const long *pagePointers;
+        locate(page, count, keyData, pagePointers);
+
+        pointers.assign(pagePointers, pagePointers + (leaf ? count : count + 1));
+        keys.clear();
+        for (long i = 0; i < count; ++i) {
+            keys.push_back(key(page, keyData, count, i));
+        }
+        highKey = KeyFormat<string>::highKey(page, keyData, count);
+    }
+
+    string KeyFormat<string>::key(const char *page, const char *keyData, long count, long i) {
+        long start = heapStart(page, keyData, count);
+        long begin = offset(keyData, i, start);
+        long end = max(begin, offset(keyData, i + 1, start));
+
+        string key(page + start, prefixLength(page, start));
+        return key.append(page + begin, end - begin);
+    }
+
+    string KeyFormat<string>::highKey(const char *page, const char *keyData, long count) {
+        int length;
+        memcpy((char *) &length, page + HIGH_KEY_OFFSET, sizeof(length));
+        if (length < 0) {
+            return infinity();
+        }
+
+        long start = heapStart(page, keyData, count) + prefixLength(page, heapStart(page, keyData, count));
+        return string(page + start, min((long) length, pageSize - start));
+    }
+
+    long KeyFormat<string>::searchPage(const char *page, const char *keyData, long count, const string &key) {
+        // All the keys share the prefix, so the key is compared with it once
+        long start = heapStart(page, keyData, count);
+        long prefix = prefixLength(page, start);
+        int order = memcmp(key.data(), page + start, min((long) key.size(), prefix));
+        if (order < 0 || (order == 0 && (long) key.size() < prefix)) {
+            return 0;
+        }
+        if (order > 0) {
+            return count;
+        }
+
+        // Binary search over the rests of the keys
+        const char *rest = key.data() + prefix;
+        long restLength = key.size() - prefix;
+        long low = 0;
+        long high = count;
+        while (low < high) {
+            long middle = (low + high) / 2;
+            long begin = offset(keyData, middle, start);
+            long end = max(begin, offset(keyData, middle + 1, start));
+            if (compareBytes(page + begin, end - begin, rest, restLength) < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        return low;
+    }
+
+    // What the engine does, counted for each thread. Splits are counted for
+    // each level above the leaves, the higher ones with the last level.
+    enum Counter {
+        PAGE_READS,                             // Pages read into the pool
+        PAGE_WRITES,                            // Pages written back
+        BYTES_READ,
+        BYTES_WRITTEN,
+        NODE_VIEWS,                             // Pages read in place
+        CACHE_HITS,                             // Nodes found in the pool
+        CACHE_MISSES,
+        EVICTIONS,
+        OBJECT_READS,                           // Records read
+        OBJECT_SCANS,                           // Reads of the object file
+        OBJECT_BYTES,                           // Bytes scanned for records
+        PREFETCHES,                             // Pages read in the background
+        SPLITS,
+        COUNTERS = SPLITS + SPLIT_LEVELS
+    };
+
+    const char *counterNames[] = {"pageReads", "pageWrites", "bytesRead", "bytesWritten", "nodeViews",
+        "cacheHits", "cacheMisses", "evictions", "objectReads", "objectScans", "objectBytes", "prefetches"};
+
+    // Values of the counters, of a thread or added up over all of them
+    struct Cost {
+        long values[COUNTERS];
+
+        Cost() { fill(values, values + COUNTERS, 0); }
+
+        // Return what was counted since before
+        Cost operator-(const Cost &before) const {
+            Cost cost;
+            for (long i = 0; i < COUNTERS; ++i) {
+                cost.values[i] = values[i] - before.values[i];
+            }
+            return cost;
+        }
+
+        // Print the counters which are not zero as name value pairs, or
+        // all of them as a JSON object
+        void print(ostream &out);
+        void printJson(ostream &out);
+    };
+
+    void Cost::print(ostream &out) {
+        for (long i = 0; i < COUNTERS; ++i) {
+            if (values[i] == 0) {
+                continue;
+            }
+            if (i < SPLITS) {
+                out << " " << counterNames[i] << " " << values[i];
+            } else {
+                out << " splits[" << i - SPLITS << "] " << values[i];
+            }
+        }
+    }
+
+    void Cost::printJson(ostream &out) {
+        out << "{";
+        for (long i = 0; i < SPLITS; ++i) {
+            out << "\"" << counterNames[i] << "\": " << values[i] << ", ";
+        }
+        out << "\"splits\": [";
+        for (long i = SPLITS; i < COUNTERS; ++i) {
+            out << (i == SPLITS ? "" : ", ") << values[i];
+        }
+        out << "]}";
+    }
+
+    // The counters of a thread. Only the thread itself changes them, so
+    // they are added to without an atomic read modify write, and others
+    // read them when adding up. Counters of threads which are done are kept
+    // in retired.
+    class ThreadCounters {
+        private:
+            atomic<long> values[COUNTERS];
+
+            static mutex access;                // Guards live and retired
+            static vector<ThreadCounters *> live;
+            static Cost retired;
+
+        public:
+            ThreadCounters();
+            ~ThreadCounters();
+
+            void add(Counter counter, long amount = 1) {
+                values[counter].store(values[counter].load(memory_order_relaxed) + amount, memory_order_relaxed);
+            }
+
+            // Return the counts of this thread
+            Cost read();
+
+            // Return the counts of all the threads
+            static Cost total();
+    };
+
+    mutex ThreadCounters::access;
+    vector<ThreadCounters *> ThreadCounters::live;
+    Cost ThreadCounters::retired;
+
+    ThreadCounters::ThreadCounters() {
+        for (auto &value : values) {
+            value = 0;
+        }
+        lock_guard<mutex> guard(access);
+        live.push_back(this);
+    }
+
+    ThreadCounters::~ThreadCounters() {
+        Cost counts = read();
+        lock_guard<mutex> guard(access);
+        for (long i = 0; i < COUNTERS; ++i) {
+            retired.values[i] += counts.values[i];
+        }
+        live.erase(find(live.begin(), live.end(), this));
+    }
+
+    Cost ThreadCounters::read() {
+        Cost cost;
+        for (long i = 0; i < COUNTERS; ++i) {
+            cost.values[i] = values[i].load(memory_order_relaxed);
+        }
+        return cost;
+    }
+
+    Cost ThreadCounters::total() {
+        lock_guard<mutex> guard(access);
+        Cost cost = retired;
+        for (auto counters : live) {
+            Cost counts = counters->read();
+            for (long i = 0; i < COUNTERS; ++i) {
+                cost.values[i] += counts.values[i];
+            }
+        }
+        return cost;
+    }
+
+    thread_local ThreadCounters counters;
+
+    // Records are stored one per line in a single file and addressed by the
+    // byte offset at which their line starts. Appends are buffered in memory
+    // and written out in groups.
+    class ObjectStore {
+        private:
+            int descriptor;                     // Persistent file descriptor
+            long fileSize;                      // Offset of the next record
+            atomic<long> flushedSize;           // Bytes already in the file
+            string pending;                     // Records not yet written
+            long pendingRecords;
+            mutex access;                       // Guards everything above,
+                                                // flushedSize only grows
+
+            long bufferSize;                    // Flush once pending is this big
+            long flushInterval;                 // Flush after these many records
+
+            // Write the pending records, with access held
+            void flushPending();
+
+        public:
+            ObjectStore(string fileName, long _bufferSize, long _flushInterval);
+            ~ObjectStore();
+
+            // Append a record and return its offset
+            long append(const string &dataString);
+
+            // Read the record at the given offset
+            string read(long offset);
+
+            // Write the pending records to the file
+            void flush();
+
+            // Write the pending records and make the file durable
+            void sync();
+
+            // Return the offset of the next record
+            long size();
+
+            // Drop the records from size on, before any are appended
+            void truncate(long size);
+
+            // Put back a record at its offset, when replaying the log
+            void restore(long offset, const string &dataString);
+    };
+
+    ObjectStore::ObjectStore(string fileName, long _bufferSize, long _flushInterval)
+        : pendingRecords(0), bufferSize(_bufferSize), flushInterval(_flushInterval) {
+        descriptor = open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+        if (descriptor < 0) {
+            cout << "Unable to open " << fileName;
+            exit(1);
+        }
+
+        // New records go to the end of the file
+        struct stat fileStat;
+        fstat(descriptor, &fileStat);
+        fileSize = fileStat.st_size;
+        flushedSize = fileSize;
+    }
+
+    ObjectStore::~ObjectStore() {
+        flush();
+        close(descriptor);
+    }
+
+    long ObjectStore::append(const string &dataString) {
+        lock_guard<mutex> guard(access);
+
+        // The offset is known right away even though the write is deferred
+        long offset = fileSize;
+        pending.append(dataString);
+        pending.push_back('\n');
+        fileSize = flushedSize + (long) pending.size();
+        pendingRecords++;
+
+        if ((long) pending.size() >= bufferSize
+                || (flushInterval > 0 && pendingRecords >= flushInterval)) {
+            flushPending();
+        }
+
+        return offset;
+    }
+
+    void ObjectStore::flush() {
+        lock_guard<mutex> guard(access);
+        flushPending();
+    }
+
+    void ObjectStore::sync() {
+        lock_guard<mutex> guard(access);
+        flushPending();
+        if (fdatasync(descriptor) != 0) {
+            cout << "Unable to sync the object store";
+            exit(1);
+        }
+    }
+
+    long ObjectStore::size() {
+        lock_guard<mutex> guard(access);
+        return fileSize;
+    }
+
+    void ObjectStore::truncate(long size) {
+        lock_guard<mutex> guard(access);
+        if (ftruncate(descriptor, size) != 0) {
+            cout << "Unable to truncate the object store";
+            exit(1);
+        }
+        fileSize = flushedSize = size;
+    }
+
+    void ObjectStore::restore(long offset, const string &dataString) {
+        lock_guard<mutex> guard(access);
+        flushPending();
+
+        string record = dataString + '\n';
+        if (pwrite(descriptor, record.data(), record.size(), offset) != (long) record.size()) {
+            cout << "Unable to write to the object store";
+            exit(1);
+        }
+
+        // Records need not be put back in order
+        fileSize = max(fileSize, offset + (long) record.size());
+        flushedSize = fileSize;
+    }
+
+    void ObjectStore::flushPending() {
+        if (pending.empty()) {
+            return;
+        }
+
+        if (pwrite(descriptor, pending.data(), pending.size(), flushedSize) != (long) pending.size()) {
+            cout << "Unable to write to the object store";
+            exit(1);
+        }
+
+        flushedSize += pending.size();
+        pending.clear();
+        pendingRecords = 0;
+    }
+
+    string ObjectStore::read(long offset) {
+        // Records which are still buffered are served from memory, the ones
+        // in the file do not change and are read without holding access
+        counters.add(OBJECT_READS);
+        if (offset >= flushedSize) {
+            lock_guard<mutex> guard(access);
+            if (offset >= flushedSize) {
+                long start = offset - flushedSize;
+                return pending.substr(start, pending.find('\n', start) - start);
+            }
+        }
+
+        string dataString;
+        char buffer[OBJECT_READ_SIZE];
+
+        // Most records fit in a single read, keep reading till the newline
+        while (true) {
+            long bytes = pread(descriptor, buffer, OBJECT_READ_SIZE, offset);
+            if (bytes <= 0) {
+                return dataString;
+            }
+            counters.add(OBJECT_SCANS);
+            counters.add(OBJECT_BYTES, bytes);
+
+            char *newline = (char *) memchr(buffer, '\n', bytes);
+            if (newline != nullptr) {
+                return dataString.append(buffer, newline - buffer);
+            }
+
+            dataString.append(buffer, bytes);
+            offset += bytes;
+        }
+    }
+
+    ObjectStore *objectStore = nullptr;
+
+    // Database objects
+    class DBObject {
+        private:
+            Key key;
+            long fileIndex;                     // Offset in the object store
+            string dataString;
+            bool loaded;                        // If dataString has been read
+
+        public:
+            static atomic<long> objectCount;
+
+        public:
+            DBObject(Key _key, string _dataString) : key(_key), dataString(_dataString), loaded(true) {
+                long sequence = objectCount++;
+
+                // Short strings are kept in the leaf, the rest are appended
+                // to the object store
+                if (inlineValueSize > 0 && (long) dataString.size() <= inlineValueSize) {
+                    fileIndex = inlinePointer(sequence, dataString.size());
+                } else {
+                    fileIndex = objectStore->append(dataString);
+                }
+            }
+
+            // The dataString is read from its offset once it is asked for
+            DBObject(Key _key, long _fileIndex) : key(_key), fileIndex(_fileIndex), loaded(false) {}
+
+            DBObject(Key _key, long _fileIndex, string _dataString)
+                : key(_key), fileIndex(_fileIndex), dataString(_dataString), loaded(true) {}
+
+            // Open the object store
+            static void initialize();
+
+            // Return the key of the object
+            Key getKey() { return key; }
+
+            // Return the string
+            string getDataString() {
+                if (!loaded) {
+                    dataString = objectStore->read(fileIndex);
+                    loaded = true;
+                }
+                return dataString;
+            }
+
+            // Return the fileIndex
+            long getFileIndex() { return fileIndex; }
+
+            // Object pointer of the object with the given sequence number
+            // whose string of length bytes is kept in a leaf. The sequence
+            // tells objects with the same key apart.
+            static long inlinePointer(long sequence, long length) {
+                return INLINE_VALUE | (sequence << 8) | length;
+            }
+
+            // Check if the string of an object is kept in a leaf, for
+            // pointers of removed entries as well, and return its length
+            static bool isInline(long objectPointer) {
+                return (objectPointer < 0 ? ~objectPointer : objectPointer) & INLINE_VALUE;
+            }
+            static long inlineLength(long objectPointer) {
+                return (objectPointer < 0 ? ~objectPointer : objectPointer) & 0xff;
+            }
+    };
+
+    atomic<long> DBObject::objectCount(0);
+
+    void DBObject::initialize() {
+        objectStore = new ObjectStore(OBJECT_FILE,
+                getOption("objectBufferSize", DEFAULT_OBJECT_BUFFER_SIZE),
+                getOption("objectFlushInterval", 0));
+    }
+
+    // Worker threads which run tasks in the order they are handed in
+    class ThreadPool {
+        private:
+            vector<thread> workers;
+            queue< function<void()> > tasks;
+            bool stopping;
+            mutex access;                       // Guards tasks and stopping
+            condition_variable changed;
+
+            // Run tasks till the pool is stopped and nothing is left
+            void work();
+
+        public:
+            ThreadPool(long threads);
+
+            // Finish the tasks handed in and stop the workers
+            ~ThreadPool();
+
+            // Hand in a task
+            void submit(function<void()> task);
+    };
+
+    ThreadPool::ThreadPool(long threads) : stopping(false) {
+        for (long i = 0; i < threads; ++i) {
+            workers.push_back(thread(&ThreadPool::work, this));
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            lock_guard<mutex> guard(access);
+            stopping = true;
+        }
+        changed.notify_all();
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    void ThreadPool::submit(function<void()> task) {
+        {
+            lock_guard<mutex> guard(access);
+            tasks.push(std::move(task));
+        }
+        changed.notify_one();
+    }
+
+    void ThreadPool::work() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(access);
+                changed.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+
+            task();
+        }
+    }
+
+    // Reads pages of a file in the background, many at a time, so that they
+    // are in the page cache when the mapping or a read of the page needs
+    // them. The pages are read into scratch buffers and dropped.
+    class PageReader {
+        public:
+            virtual ~PageReader() {}
+
+            // Start reading the pages at the given offsets. Reads past depth
+            // in flight are dropped, the caller never waits for a read.
+            virtual void read(const vector<long> &offsets) = 0;
+
+            // Return a reader of pages of pageSize bytes of the file with up
+            // to depth reads in flight, through io_uring if the kernel has
+            // it and asked to use it, else through a pool of threads
+            static PageReader *create(int descriptor, long pageSize, long depth, bool useRing);
+    };
+
+    // Reads on IO_THREADS threads of a pool, each waiting for one read
+    class ThreadedReader : public PageReader {
+        private:
+            int descriptor;
+            long pageSize;
+            long depth;
+            atomic<long> inFlight;
+            ThreadPool pool;
+
+        public:
+            ThreadedReader(int _descriptor, long _pageSize, long _depth)
+                : descriptor(_descriptor), pageSize(_pageSize), depth(_depth), inFlight(0), pool(IO_THREADS) {}
+
+            void read(const vector<long> &offsets);
+    };
+
+    void ThreadedReader::read(const vector<long> &offsets) {
+        for (auto offset : offsets) {
+            // Reads past the depth are dropped rather than queued, they
+            // would only be done after the pages are needed
+            if (inFlight >= depth) {
+                return;
+            }
+            inFlight++;
+
+            pool.submit([this, offset]() {
+                thread_local vector<char> scratch;
+                scratch.resize(pageSize);
+                if (pread(descriptor, scratch.data(), pageSize, offset) < 0) {
+                    // Reading ahead is only a hint
+                }
+                inFlight--;
+            });
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    // Reads submitted to an io_uring, the whole batch with a single system
+    // call. Every read in flight owns a slot with a scratch buffer, slots are
+    // given back as the completions are reaped.
+    class RingReader : public PageReader {
+        private:
+            int descriptor;
+            long pageSize;
+            int ring;                           // File descriptor of the ring
+            void *submissionMapping;
+            void *completionMapping;
+            size_t submissionSize;
+            size_t completionSize;
+            io_uring_sqe *entries;              // Submission queue entries
+            size_t entriesSize;
+            unsigned *submissionTail;
+            unsigned *submissionMask;
+            unsigned *submissionArray;
+            unsigned *completionHead;
+            unsigned *completionTail;
+            unsigned *completionMask;
+            io_uring_cqe *completions;
+            vector<char> buffers;               // Scratch buffer of each slot
+            vector<long> freeSlots;
+            long depth;
+            mutex access;                       // Guards the rings and slots
+
+            // Give back the slots of the reads which finished, with access
+            // held. If wait, wait for at least one read to finish first.
+            void reap(bool wait);
+
+            RingReader(int _descriptor, long _pageSize) : descriptor(_descriptor), pageSize(_pageSize), ring(-1) {}
+
+        public:
+            ~RingReader();
+
+            // Set up a ring, return nullptr if the kernel does not allow it
+            static RingReader *create(int descriptor, long pageSize, long depth);
+
+            void read(const vector<long> &offsets);
+    };
+
+    RingReader *RingReader::create(int descriptor, long pageSize, long depth) {
+        io_uring_params parameters;
+        memset(&parameters, 0, sizeof(parameters));
+        int ring = syscall(__NR_io_uring_setup, depth, &parameters);
+        if (ring < 0) {
+            return nullptr;
+        }
+
+        RingReader *reader = new RingReader(descriptor, pageSize);
+        reader->ring = ring;
+        reader->depth = parameters.sq_entries;
+
+        // Map the submission and completion rings, which may share a mapping
+        reader->submissionSize = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+        reader->completionSize = parameters.cq_off.cqes + parameters.cq_entries * sizeof(io_uring_cqe);
+        bool single = parameters.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            reader->submissionSize = reader->completionSize = max(reader->submissionSize, reader->completionSize);
+        }
+        reader->submissionMapping = mmap(nullptr, reader->submissionSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        reader->completionMapping = single ? reader->submissionMapping
+            : mmap(nullptr, reader->completionSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        reader->entriesSize = parameters.sq_entries * sizeof(io_uring_sqe);
+        void *entries = mmap(nullptr, reader->entriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring, IORING_OFF_SQES);
+        if (reader->submissionMapping == MAP_FAILED || reader->completionMapping == MAP_FAILED || entries == MAP_FAILED) {
+            cout << "Unable to map the io_uring";
+            exit(1);
+        }
+        reader->entries = (io_uring_sqe *) entries;
+
+        char *submission = (char *) reader->submissionMapping;
+        reader->submissionTail = (unsigned *) (submission + parameters.sq_off.tail);
+        reader->submissionMask = (unsigned *) (submission + parameters.sq_off.ring_mask);
+        reader->submissionArray = (unsigned *) (submission + parameters.sq_off.array);
+
+        char *completion = (char *) reader->completionMapping;
+        reader->completionHead = (unsigned *) (completion + parameters.cq_off.head);
+        reader->completionTail = (unsigned *) (completion + parameters.cq_off.tail);
+        reader->completionMask = (unsigned *) (completion + parameters.cq_off.ring_mask);
+        reader->completions = (io_uring_cqe *) (completion + parameters.cq_off.cqes);
+
+        reader->buffers.resize(reader->depth * pageSize);
+        for (long slot = reader->depth - 1; slot >= 0; --slot) {
+            reader->freeSlots.push_back(slot);
+        }
+
+        return reader;
+    }
+
+    RingReader::~RingReader() {
+        // The kernel writes into the buffers till the reads are done
+        lock_guard<mutex> guard(access);
+        while ((long) freeSlots.size() < depth) {
+            reap(true);
+        }
+
+        munmap(entries, entriesSize);
+        if (completionMapping != submissionMapping) {
+            munmap(completionMapping, completionSize);
+        }
+        munmap(submissionMapping, submissionSize);
+        close(ring);
+    }
+
+    void RingReader::reap(bool wait) {
+        if (wait && syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+            cout << "Unable to wait for the io_uring";
+            exit(1);
+        }
+
+        unsigned head = *completionHead;
+        unsigned tail = __atomic_load_n(completionTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            // Failed reads are only missed hints
+            freeSlots.push_back(completions[head & *completionMask].user_data);
+        }
+        __atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+    }
+
+    void RingReader::read(const vector<long> &offsets) {
+        lock_guard<mutex> guard(access);
+        reap(false);
+
+        long submitted = 0;
+        unsigned tail = *submissionTail;
+        for (auto offset : offsets) {
+            // Reads past the depth are dropped, as ThreadedReader does
+            if (freeSlots.empty()) {
+                break;
+            }
+
+            long slot = freeSlots.back();
+            freeSlots.pop_back();
+
+            unsigned index = tail & *submissionMask;
+            io_uring_sqe &entry = entries[index];
+            memset(&entry, 0, sizeof(entry));
+            entry.opcode = IORING_OP_READ;
+            entry.fd = descriptor;
+            entry.off = offset;
+            entry.addr = (unsigned long) (buffers.data() + slot * pageSize);
+            entry.len = pageSize;
+            entry.user_data = slot;
+            submissionArray[index] = index;
+            ++tail;
+            ++submitted;
+        }
+
+        __atomic_store_n(submissionTail, tail, __ATOMIC_RELEASE);
+        if (submitted > 0 && syscall(__NR_io_uring_enter, ring, submitted, 0, 0, nullptr, 0) < 0) {
+            cout << "Unable to submit to the io_uring";
+            exit(1);
+        }
+    }
+#endif
+
+    PageReader *PageReader::create(int descriptor, long pageSize, long depth, bool useRing) {
+#ifdef HAVE_IO_URING
+        if (useRing) {
+            RingReader *reader = RingReader::create(descriptor, pageSize, depth);
+            if (reader != nullptr) {
+                return reader;
+            }
+        }
+#endif
+        return new ThreadedReader(descriptor, pageSize, depth);
+    }
+
+    // All the nodes of the tree live in a single file, the node with a given
+    // fileIndex is stored in the page at offset fileIndex * pageSize
+    class PageFile {
+        private:
+            int descriptor;                     // Persistent file descriptor
+            long pageSize;
+            atomic<long> allocatedPages;        // Pages preallocated on disk
+            mutex growth;                       // Held while the file grows
+            const char *mapping;                // Read only mapping of the file
+            PageReader *reader;                 // Reads pages in the background
+
+            // Make sure that the page is backed by the file
+            void allocate(long pageIndex);
+
+        public:
+            PageFile(string fileName, long _pageSize);
+            ~PageFile();
+
+            // Read a page into the buffer
+            void readPage(long pageIndex, char *buffer);
+
+            // Write the buffer to a page
+            void writePage(long pageIndex, const char *buffer);
+
+            // Get the page in place from the mapping
+            const char *mappedPage(long pageIndex) { return mapping + pageIndex * pageSize; }
+
+            // Start reading pages in the background, all at once
+            void prefetch(long pageIndex) { prefetch(vector<long>(1, pageIndex)); }
+            void prefetch(const vector<long> &pageIndices);
+
+            // Make the pages written so far durable
+            void sync();
+
+            // Return the size of a page
+            long getPageSize() { return pageSize; }
+    };
+
+    PageFile::PageFile(string fileName, long _pageSize) : pageSize(_pageSize) {
+        descriptor = open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+        if (descriptor < 0) {
+            cout << "Unable to open " << fileName;
+            exit(1);
+        }
+
+        // Pages which already exist need not be allocated again
+        struct stat fileStat;
+        fstat(descriptor, &fileStat);
+        allocatedPages = fileStat.st_size / pageSize;
+
+        // Reserve enough address space so that the file can grow under the
+        // mapping without having to move it
+        void *address = mmap(nullptr, MAPPING_SIZE, PROT_READ, MAP_SHARED, descriptor, 0);
+        if (address == MAP_FAILED) {
+            cout << "Unable to map " << fileName;
+            exit(1);
+        }
+        mapping = (const char *) address;
+
+        reader = PageReader::create(descriptor, pageSize, getOption("ioDepth", DEFAULT_IO_DEPTH),
+                getOption("ioUring", 1));
+    }
+
+    PageFile::~PageFile() {
+        delete reader;
+        munmap((void *) mapping, MAPPING_SIZE);
+        close(descriptor);
+    }
+
+    void PageFile::allocate(long pageIndex) {
+        if (pageIndex < allocatedPages) {
+            return;
+        }
+
+        // Someone else may have grown the file in the meantime
+        lock_guard<mutex> guard(growth);
+        if (pageIndex < allocatedPages) {
+            return;
+        }
+
+        if ((pageIndex + 1) * pageSize > MAPPING_SIZE) {
+            cout << "Tree file is larger than the mapping";
+            exit(1);
+        }
+
+        // Grow the file in chunks to avoid extending it on every new node
+        long pages = (pageIndex / PREALLOCATE_PAGES + 1) * PREALLOCATE_PAGES;
+        if (posix_fallocate(descriptor, 0, pages * pageSize) != 0) {
+            cout << "Unable to allocate pages for the tree";
+            exit(1);
+        }
+        allocatedPages = pages;
+    }
+
+    void PageFile::readPage(long pageIndex, char *buffer) {
+        if (pread(descriptor, buffer, pageSize, pageIndex * pageSize) != pageSize) {
+            cout << "Unable to read page " << pageIndex;
+            exit(1);
+        }
+        counters.add(PAGE_READS);
+        counters.add(BYTES_READ, pageSize);
+    }
+
+    void PageFile::prefetch(const vector<long> &pageIndices) {
+        // Pages past the end of the file are new and not worth reading
+        vector<long> offsets;
+        for (auto pageIndex : pageIndices) {
+            if (pageIndex >= 0 && pageIndex < allocatedPages) {
+                offsets.push_back(pageIndex * pageSize);
+            }
+        }
+
+        counters.add(PREFETCHES, offsets.size());
+        if (!offsets.empty()) {
+            reader->read(offsets);
+        }
+    }
+
+    void PageFile::writePage(long pageIndex, const char *buffer) {
+        allocate(pageIndex);
+        if (pwrite(descriptor, buffer, pageSize, pageIndex * pageSize) != pageSize) {
+            cout << "Unable to write page " << pageIndex;
+            exit(1);
+        }
+        counters.add(PAGE_WRITES);
+        counters.add(BYTES_WRITTEN, pageSize);
+    }
+
+    void PageFile::sync() {
+        if (fdatasync(descriptor) != 0) {
+            cout << "Unable to sync the tree";
+            exit(1);
+        }
+    }
+
+    PageFile *treeFile = nullptr;
+
+    // Kinds of records in the write ahead log
+    enum LogRecordType {
+        LOG_CHECKPOINT = 1,                     // Session the log starts from
+        LOG_PAGE = 2,                           // Page as of the checkpoint
+        LOG_INSERT = 3,                         // Key and object inserted
+        LOG_REMOVE = 4                          // Key and objectPointer removed
+    };
+
+    // An insert or remove found in the log
+    struct LoggedChange {
+        long type;
+        Key key;
+        long objectPointer;                     // DEFAULT_LOCATION removes all
+        string dataString;
+    };
+
+    struct LogRecordHeader {
+        long type;
+        long size;                              // Bytes of payload that follow
+        unsigned long checksum;                 // Of the type and payload
+    };
+
+    // FNV-1a hash of a record, a torn record at the end of the log does not
+    // match its checksum
+    unsigned long logChecksum(long type, const char *payload, long size) {
+        unsigned long hash = 14695981039346656037UL ^ type;
+        for (long i = 0; i < size; ++i) {
+            hash = (hash ^ (unsigned char) payload[i]) * 1099511628211UL;
+        }
+        return hash;
+    }
+
+    // Log of the changes since the last checkpoint. A checkpoint writes back
+    // all the nodes and records, and starts a new log with the session. The
+    // tree and object files then only change in place as follows:
+    //   - Inserts and removes are logged before they change the tree, and
+    //     made durable in groups with a single sync for many of them.
+    //   - The first time a page of the checkpoint is changed, its contents as
+    //     of the checkpoint are logged. The record has to be durable before
+    //     the page is written back, pages written back later need nothing.
+    // Recovery puts back the logged pages, which gives the tree of the
+    // checkpoint, and the inserts and removes are replayed on it.
+    class WriteAheadLog {
+        private:
+            string fileName;
+            int descriptor;                     // -1 if there is no log yet
+            bool active;                        // Set once there is a checkpoint
+            long groupSize;                     // Changes made durable together
+            long checkpointInterval;            // Changes between checkpoints
+
+            string pending;                     // Records not yet written
+            long pendingChanges;
+            long appendedSize;                  // Bytes logged so far
+            long durableSize;                   // Bytes synced to the file
+            bool syncing;                       // Set while a sync writes
+            long checkpointPages;               // Pages as of the checkpoint
+            unordered_map<long, long> journaled;  // End of the record of each
+                                                // page logged since then
+            mutex access;                       // Guards everything above
+            condition_variable synced;
+
+            pthread_rwlock_t checkpointLatch;   // Held shared by changes
+            atomic<long> changeCount;           // Changes since the checkpoint
+
+            // Add a record to pending with access held, return where it ends
+            long append(LogRecordType type, const string &payload);
+
+            // Log an insert or remove, with the checkpoint latch held
+            void logChange(LogRecordType type, const string &payload);
+
+            // Make the log durable up to size
+            void sync(long size);
+
+        public:
+            WriteAheadLog(string _fileName, long _groupSize, long _checkpointInterval);
+            ~WriteAheadLog();
+
+            // Check if a log was found
+            bool exists() { return descriptor >= 0; }
+
+            // Log an insert before it changes the tree
+            void beginInsert(const Key &key, long objectPointer, const string &dataString);
+
+            // Log a remove before it changes the tree
+            void beginRemove(const Key &key, long objectPointer);
+
+            // Done with an insert or remove, return true if a checkpoint is due
+            bool endChange();
+
+            // Log the page as of the checkpoint before it is first changed
+            void journalPage(long fileIndex);
+
+            // Wait till the page may be written back
+            void beforeWrite(long fileIndex);
+
+            // Make all the records durable
+            void sync() { sync(appendedSize); }
+
+            // Keep changes out while a checkpoint is taken
+            void lockCheckpoint() { pthread_rwlock_wrlock(&checkpointLatch); }
+            void unlockCheckpoint() { pthread_rwlock_unlock(&checkpointLatch); }
+
+            // Replace the log with one holding just the session, for a tree
+            // of the given pages which is durable
+            void restart(const string &session, long pages);
+
+            // Put back the pages of the checkpoint, return its session and
+            // the changes logged after it
+            bool recover(string &session, vector<LoggedChange> &changes);
+    };
+
+    WriteAheadLog::WriteAheadLog(string _fileName, long _groupSize, long _checkpointInterval)
+        : fileName(_fileName), active(false), groupSize(max(1L, _groupSize)),
+        checkpointInterval(_checkpointInterval), pendingChanges(0), appendedSize(0),
+        durableSize(0), syncing(false), checkpointPages(0), changeCount(0) {
+        descriptor = open(fileName.c_str(), O_RDWR);
+
+        // Checkpoints should not wait behind a stream of changes
+        pthread_rwlockattr_t attributes;
+        pthread_rwlockattr_init(&attributes);
+        pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&checkpointLatch, &attributes);
+        pthread_rwlockattr_destroy(&attributes);
+    }
+
+    WriteAheadLog::~WriteAheadLog() {
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+        pthread_rwlock_destroy(&checkpointLatch);
+    }
+
+    long WriteAheadLog::append(LogRecordType type, const string &payload) {
+        LogRecordHeader header = {type, (long) payload.size(), logChecksum(type, payload.data(), payload.size())};
+        pending.append((const char *) &header, sizeof(header));
+        pending.append(payload);
+        appendedSize += sizeof(header) + payload.size();
+
+        return appendedSize;
+    }
+
+    void WriteAheadLog::sync(long size) {
+        unique_lock<mutex> lock(access);
+        while (durableSize < size) {
+            // The sync in progress may cover our records
+            if (syncing) {
+                synced.wait(lock);
+                continue;
+            }
+
+            // Write everything pending, later records go to a new buffer
+            syncing = true;
+            string records;
+            records.swap(pending);
+            pendingChanges = 0;
+            long offset = durableSize;
+            long end = appendedSize;
+            lock.unlock();
+
+            if (pwrite(descriptor, records.data(), records.size(), offset) != (long) records.size()
+                    || fdatasync(descriptor) != 0) {
+                cout << "Unable to write the log";
+                exit(1);
+            }
+
+            lock.lock();
+            durableSize = end;
+            syncing = false;
+            synced.notify_all();
+        }
+    }
+
+    void WriteAheadLog::logChange(LogRecordType type, const string &payload) {
+        if (!active) {
+            return;
+        }
+
+        long end;
+        bool full;
+        {
+            lock_guard<mutex> guard(access);
+            end = append(type, payload);
+            full = ++pendingChanges >= groupSize;
+        }
+
+        // Group commit, the changes since the last sync are synced together
+        if (full) {
+            sync(end);
+        }
+    }
+
+    void WriteAheadLog::beginInsert(const Key &key, long objectPointer, const string &dataString) {
+        pthread_rwlock_rdlock(&checkpointLatch);
+
+        string payload;
+        KeyFormat<Key>::encode(key, payload);
+        payload.append((const char *) &objectPointer, sizeof(objectPointer));
+        payload.append(dataString);
+        logChange(LOG_INSERT, payload);
+    }
+
+    void WriteAheadLog::beginRemove(const Key &key, long objectPointer) {
+        pthread_rwlock_rdlock(&checkpointLatch);
+
+        string payload;
+        KeyFormat<Key>::encode(key, payload);
+        payload.append((const char *) &objectPointer, sizeof(objectPointer));
+        logChange(LOG_REMOVE, payload);
+    }
+
+    bool WriteAheadLog::endChange() {
+        pthread_rwlock_unlock(&checkpointLatch);
+
+        // Only the change which reaches the interval asks for a checkpoint
+        return active && checkpointInterval > 0 && ++changeCount == checkpointInterval;
+    }
+
+    void WriteAheadLog::journalPage(long fileIndex) {
+        // Pages made since the checkpoint are not in it
+        if (!active || fileIndex > checkpointPages) {
+            return;
+        }
+
+        lock_guard<mutex> guard(access);
+        if (journaled.count(fileIndex) > 0) {
+            return;
+        }
+
+        // The page in the file is still as of the checkpoint
+        string payload((const char *) &fileIndex, sizeof(fileIndex));
+        payload.resize(sizeof(fileIndex) + treeFile->getPageSize());
+        treeFile->readPage(fileIndex, &payload[sizeof(fileIndex)]);
+        journaled[fileIndex] = append(LOG_PAGE, payload);
+    }
+
+    void WriteAheadLog::beforeWrite(long fileIndex) {
+        long end;
+        {
+            lock_guard<mutex> guard(access);
+            auto record = journaled.find(fileIndex);
+            if (record == journaled.end() || record->second <= durableSize) {
+                return;
+            }
+            end = record->second;
+        }
+
+        sync(end);
+    }
+
+    void WriteAheadLog::restart(const string &session, long pages) {
+        // Write the new log next to the old one, and switch over in one step
+        string newFileName = fileName + ".new";
+        int newDescriptor = open(newFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (newDescriptor < 0) {
+            cout << "Unable to open " << newFileName;
+            exit(1);
+        }
+
+        lock_guard<mutex> guard(access);
+        pending.clear();
+        appendedSize = 0;
+        string payload((const char *) &pages, sizeof(pages));
+        payload.append(session);
+        append(LOG_CHECKPOINT, payload);
+
+        if (pwrite(newDescriptor, pending.data(), pending.size(), 0) != (long) pending.size()
+                || fdatasync(newDescriptor) != 0
+                || rename(newFileName.c_str(), fileName.c_str()) != 0) {
+            cout << "Unable to write the log";
+            exit(1);
+        }
+
+        // Make the rename durable
+        int directory = open(fileName.substr(0, fileName.rfind('/')).c_str(), O_RDONLY);
+        if (directory >= 0) {
+            fsync(directory);
+            close(directory);
+        }
+
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+        descriptor = newDescriptor;
+
+        pending.clear();
+        pendingChanges = 0;
+        durableSize = appendedSize;
+        checkpointPages = pages;
+        journaled.clear();
+        changeCount = 0;
+        active = true;
+    }
+
+    bool WriteAheadLog::recover(string &session, vector<LoggedChange> &changes) {
+        // Read in the whole log
+        struct stat fileStat;
+        fstat(descriptor, &fileStat);
+        string contents(fileStat.st_size, '\0');
+        if (pread(descriptor, &contents[0], contents.size(), 0) != (long) contents.size()) {
+            cout << "Unable to read the log";
+            exit(1);
+        }
+
+        // Go over the records till the end, or till a torn record
+        long location = 0;
+        while (location + (long) sizeof(LogRecordHeader) <= (long) contents.size()) {
+            LogRecordHeader header;
+            memcpy((char *) &header, contents.data() + location, sizeof(header));
+            const char *payload = contents.data() + location + sizeof(header);
+            if (header.size < 0 || header.size > (long) contents.size() - location - (long) sizeof(header)
+                    || header.checksum != logChecksum(header.type, payload, header.size)) {
+                break;
+            }
+
+            // The log starts with the checkpoint
+            if ((location == 0) != (header.type == LOG_CHECKPOINT)) {
+                break;
+            }
+            location += sizeof(header) + header.size;
+
+            if (header.type == LOG_CHECKPOINT) {
+                memcpy((char *) &checkpointPages, payload, sizeof(checkpointPages));
+                session.assign(payload + sizeof(checkpointPages), header.size - sizeof(checkpointPages));
+            } else if (header.type == LOG_PAGE) {
+                // Put back the page as of the checkpoint
+                long fileIndex;
+                memcpy((char *) &fileIndex, payload, sizeof(fileIndex));
+                treeFile->writePage(fileIndex, payload + sizeof(fileIndex));
+                journaled[fileIndex] = location;
+            } else if (header.type == LOG_INSERT || header.type == LOG_REMOVE) {
+                LoggedChange change;
+                change.type = header.type;
+                long keySize = KeyFormat<Key>::decode(payload, change.key);
+                memcpy((char *) &change.objectPointer, payload + keySize, sizeof(change.objectPointer));
+
+                long headerSize = keySize + sizeof(change.objectPointer);
+                change.dataString.assign(payload + headerSize, header.size - headerSize);
+                changes.push_back(change);
+            }
+        }
+
+        if (location == 0) {
+            return false;
+        }
+
+        // Later records go after the last whole one
+        if (ftruncate(descriptor, location) != 0) {
+            cout << "Unable to truncate the log";
+            exit(1);
+        }
+        appendedSize = durableSize = location;
+        active = true;
+
+        return true;
+    }
+
+    WriteAheadLog *writeAheadLog = nullptr;
+
+    // Writer latches and versions of the pages, indexed by fileIndex. Page 0
+    // holds no node, its latch guards which node is the root. The version of
+    // a page is odd while the page is being written, so readers can copy a
+    // page without a latch and check that it did not change meanwhile. Both
+    // are made in chunks the first time a page in the chunk is used.
+    class LatchTable {
+        private:
+            struct PageLatch {
+                pthread_rwlock_t latch;
+                atomic<unsigned long> version;
+            };
+
+            long chunkCount;
+            atomic<PageLatch *> *chunks;
+            mutex growth;                       // Held while a chunk is made
+
+            // Get the latch and version of a page
+            PageLatch *page(long fileIndex);
+
+        public:
+            LatchTable(long pages);
+            ~LatchTable();
+
+            void lockExclusive(long fileIndex) { pthread_rwlock_wrlock(&page(fileIndex)->latch); }
+            bool tryLockExclusive(long fileIndex) { return pthread_rwlock_trywrlock(&page(fileIndex)->latch) == 0; }
+            void unlock(long fileIndex) { pthread_rwlock_unlock(&page(fileIndex)->latch); }
+
+            // Bracket a write of the page
+            void beginWrite(long fileIndex) { page(fileIndex)->version++; }
+            void endWrite(long fileIndex) { page(fileIndex)->version++; }
+
+            // Get the version of a page once no write is in progress
+            unsigned long readVersion(long fileIndex);
+
+            // Check that the page is still at the version
+            bool validate(long fileIndex, unsigned long version);
+    };
+
+    LatchTable::LatchTable(long pages) {
+        chunkCount = pages / LATCH_CHUNK_SIZE + 1;
+        chunks = new atomic<PageLatch *>[chunkCount]();
+    }
+
+    LatchTable::~LatchTable() {
+        for (long i = 0; i < chunkCount; ++i) {
+            delete[] chunks[i].load();
+        }
+        delete[] chunks;
+    }
+
+    LatchTable::PageLatch *LatchTable::page(long fileIndex) {
+        atomic<PageLatch *> &chunk = chunks[fileIndex / LATCH_CHUNK_SIZE];
+        PageLatch *latches = chunk.load(memory_order_acquire);
+
+        if (latches == nullptr) {
+            lock_guard<mutex> guard(growth);
+            latches = chunk.load(memory_order_acquire);
+            if (latches == nullptr) {
+                latches = new PageLatch[LATCH_CHUNK_SIZE]();
+                for (long i = 0; i < LATCH_CHUNK_SIZE; ++i) {
+                    pthread_rwlock_init(&latches[i].latch, nullptr);
+                }
+                chunk.store(latches, memory_order_release);
+            }
+        }
+
+        return latches + fileIndex % LATCH_CHUNK_SIZE;
+    }
+
+    unsigned long LatchTable::readVersion(long fileIndex) {
+        atomic<unsigned long> &version = page(fileIndex)->version;
+        unsigned long current = version.load(memory_order_acquire);
+        while (current % 2 == 1) {
+            this_thread::yield();
+            current = version.load(memory_order_acquire);
+        }
+
+        return current;
+    }
+
+    bool LatchTable::validate(long fileIndex, unsigned long version) {
+        // The reads of the page have to be done before the version is read
+        atomic_thread_fence(memory_order_acquire);
+        return page(fileIndex)->version.load(memory_order_relaxed) == version;
+    }
+
+    LatchTable *latchTable = nullptr;
+
+    // Set while queries run on several threads, latches are only taken then
+    bool concurrent = false;
+
+    // Set once a snapshot is taken on a single thread, writers then write
+    // back the nodes they change as concurrent writers do
+    bool writeThrough = false;
+
+    void latchExclusive(long fileIndex) {
+        if (concurrent) {
+            latchTable->lockExclusive(fileIndex);
+        }
+    }
+
+    void unlatch(long fileIndex) {
+        if (concurrent) {
+            latchTable->unlock(fileIndex);
+        }
+    }
+
+    class Node {
+        public:
+            static atomic<long> fileCount;      // Count of all files
+            static vector<long> freeFileIndices;  // Pages free to be reused
+            static mutex freeAccess;            // Guards freeFileIndices
+            static long lowerBound;
+            static long upperBound;
+            static long capacity;               // Space a page has for keys
+            static long leafCapacity;           // Same for leaves with values
+            static long pageSize;
+            static void (Node::*pageWriter)();  // writePage for the pageSize
+            static void (Node::*pageReader)();  // readPage for the pageSize
+
+        private:
+            long fileIndex;                     // Name of file to store contents
+            bool leaf;                          // Type of leaf
+
+        public:
+            long nextLeafIndex;
+            long previousLeafIndex;
+            long rightLinkIndex;                // Right sibling of internal nodes
+            Key highKey;                        // Separator from the right sibling
+            vector<Key> keys;
+            vector<long> childIndices;          // FileIndices of the children
+            vector<long> objectPointers;        // To store the object pointers
+            vector<string> values;              // Values kept in a leaf, empty
+                                                // for the ones which are not
+
+        public:
+            // Basic initialization
+            Node();
+
+            // Given a fileIndex, read it
+            Node(long _fileIndex);
+
+            // Check if leaf
+            bool isLeaf() { return leaf; }
+
+            // Get the fileIndex
+            long getFileIndex() { return fileIndex; }
+
+            // set to internalNode
+            void setToInternalNode() { leaf = false; }
+
+            // Return the size of keys
+            long size() { return keys.size(); }
+
+            // Return the space taken by the keys
+            long space() { return KeyFormat<Key>::space(keys, highKey, leaf); }
+
+            // Return the space the page of the node has
+            long room() { return leaf ? leafCapacity : capacity; }
+
+            // Check if any key can be added without splitting the node
+            bool hasRoom() { return KeyFormat<Key>::spaceWithRoom(keys, highKey, leaf) <= room(); }
+
+            // Check if the node has to be split
+            bool overflows() { return space() > room(); }
+
+            // Check if the node is less than half full
+            bool underflows() { return space() < room() / 2; }
+
+            // Initialize the for the tree
+            static void initialize();
+
+            // Use the layout specialized for the page size if there is one
+            static void selectPageLayout();
+
+            // Use the bounds, search and page buffers of a PageLayout
+            template<typename Layout>
+                static void usePageLayout();
+
+            // Return the position of a key in keys
+            long getKeyPosition(const Key &key);
+
+            // Commit node to the buffer pool
+            void commitToDisk();
+
+            // Write the node into its page on disk
+            void writeToDisk() { (this->*pageWriter)(); }
+
+            // Read from the disk into memory
+            void readFromDisk() { (this->*pageReader)(); }
+
+            // Write and read the page through a buffer of PageSize bytes, 0
+            // for a page size only known at runtime
+            template<long PageSize>
+                void writePage();
+            template<long PageSize>
+                void readPage();
+
+            // Write the node into buffer and from there into its page
+            void writeToDisk(char *buffer);
+
+            // Read the page into buffer and from there into the node
+            void readFromDisk(char *buffer);
+
+            // Print node information
+            void printNode();
+
+            // Serialize the subtree
+            void serialize();
+
+            // Insert object into disk
+            void insertObject(DBObject object);
+
+            // Insert an internal node into the tree
+            void insertNode(const Key &key, long leftChildIndex, long rightChildIndex, vector<Node *> &path);
+
+            // Split the current Leaf Node
+            void splitLeaf(vector<Node *> &path);
+
+            // Split the current internal Node
+            void splitInternal(vector<Node *> &path);
+
+            // Check if the entry at position of a leaf has been removed
+            bool isRemoved(long position) { return objectPointers[position] < 0; }
+
+            // Mark the entry at position of a leaf as removed
+            void markRemoved(long position) { objectPointers[position] = ~objectPointers[position]; }
+
+            // Take the removed entries out of a leaf, return how many
+            long purge();
+
+            // Merge the child at position + 1 into the one at position if
+            // both fit in one node, else even them out. Return true if merged.
+            bool mergeChildren(long position);
+
+            // Get the fileIndex for a new node
+            static long allocateFileIndex();
+
+            // Give back the fileIndex of a node which is gone
+            static void freeFileIndex(long fileIndex);
+    };
+
+    // Initialize static variables
+    long Node::lowerBound = 0;
+    long Node::upperBound = 0;
+    long Node::capacity = 0;
+    long Node::leafCapacity = 0;
+    long Node::pageSize = 0;
+    void (Node::*Node::pageWriter)() = &Node::writePage<0>;
+    void (Node::*Node::pageReader)() = &Node::readPage<0>;
+    atomic<long> Node::fileCount(0);
+    vector<long> Node::freeFileIndices;
+    mutex Node::freeAccess;
+
+    // Pages as they were when snapshots were taken. A page which is about
+    // to be written for the first time since the newest snapshot was taken
+    // is copied to a page of the table first. Readers of a snapshot read the
+    // oldest copy made since their snapshot was taken, or the page itself if
+    // it has not been written since. Copies and the pages which left the
+    // tree are freed once no open snapshot reads them.
+    class SnapshotTable {
+        private:
+            struct PageCopy {
+                long version;                   // Newest snapshot when copied
+                long copyIndex;                 // Page holding the copy
+            };
+
+            struct RetiredPage {
+                long version;                   // Newest snapshot when freed
+                long fileIndex;
+            };
+
+            long lastVersion;                   // Version of the last snapshot
+            map<long, long> openPages;          // Pages of the tree when each
+                                                // open snapshot was taken
+            unordered_map<long, vector<PageCopy> > copies;  // Oldest first
+            vector<RetiredPage> retired;        // Pages which left the tree
+            vector<long> freeCopies;            // Pages for copies
+            atomic<long> openCount;             // Lets writes skip the table
+            mutex access;                       // Guards everything above
+
+            pthread_rwlock_t writeLatch;        // Held shared by page writes
+
+            // Copy a page which an open snapshot reads before it is written
+            void preserve(long fileIndex);
+
+        public:
+            SnapshotTable();
+            ~SnapshotTable();
+
+            // Take a snapshot of the pages as they are, return its version.
+            // Called with the writes locked out.
+            long open();
+
+            // Drop a snapshot and free the pages no open snapshot reads
+            void close(long version);
+
+            // Keep snapshots from being taken while a page is written, the
+            // page is copied first if an open snapshot reads it
+            void beginWrite(long fileIndex);
+            void endWrite() { pthread_rwlock_unlock(&writeLatch); }
+
+            // Keep page writes out while a snapshot is taken
+            void lockWrites() { pthread_rwlock_wrlock(&writeLatch); }
+            void unlockWrites() { pthread_rwlock_unlock(&writeLatch); }
+
+            // Free a page which left the tree once no open snapshot reads it
+            void freePage(long fileIndex);
+
+            // Return the page with the given fileIndex as of a snapshot
+            const char *page(long version, long fileIndex);
+
+            // Return the pages the table holds
+            vector<long> heldPages();
+    };
+
+    SnapshotTable *snapshotTable = nullptr;
+
+    SnapshotTable::SnapshotTable() : lastVersion(0), openCount(0) {
+        // Snapshots should not wait behind a stream of page writes
+        pthread_rwlockattr_t attributes;
+        pthread_rwlockattr_init(&attributes);
+        pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&writeLatch, &attributes);
+        pthread_rwlockattr_destroy(&attributes);
+    }
+
+    SnapshotTable::~SnapshotTable() {
+        pthread_rwlock_destroy(&writeLatch);
+    }
+
+    long SnapshotTable::open() {
+        lock_guard<mutex> guard(access);
+        long version = ++lastVersion;
+        openPages[version] = Node::fileCount;
+        openCount++;
+        return version;
+    }
+
+    void SnapshotTable::close(long version) {
+        lock_guard<mutex> guard(access);
+        openPages.erase(version);
+        openCount--;
+
+        // A copy is read by the snapshots taken after the copy before it was
+        // made, up to its own version
+        for (auto pageCopies = copies.begin(); pageCopies != copies.end(); ) {
+            long previous = 0;
+            long kept = 0;
+            for (auto &copy : pageCopies->second) {
+                auto reader = openPages.upper_bound(previous);
+                previous = copy.version;
+                if (reader != openPages.end() && reader->first <= copy.version) {
+                    pageCopies->second[kept++] = copy;
+                } else {
+                    freeCopies.push_back(copy.copyIndex);
+                }
+            }
+
+            pageCopies->second.resize(kept);
+            pageCopies = kept == 0 ? copies.erase(pageCopies) : next(pageCopies);
+        }
+
+        // A page which left the tree is read by the snapshots taken before
+        long kept = 0;
+        for (auto &page : retired) {
+            if (!openPages.empty() && openPages.begin()->first <= page.version) {
+                retired[kept++] = page;
+            } else {
+                Node::freeFileIndex(page.fileIndex);
+            }
+        }
+        retired.resize(kept);
+    }
+
+    void SnapshotTable::beginWrite(long fileIndex) {
+        pthread_rwlock_rdlock(&writeLatch);
+        if (openCount > 0) {
+            preserve(fileIndex);
+        }
+    }
+
+    void SnapshotTable::preserve(long fileIndex) {
+        lock_guard<mutex> guard(access);
+        if (openPages.empty()) {
+            return;
+        }
+
+        // Older snapshots have a copy already or read the page as the newest
+        // one does, and pages made since it was taken are in no snapshot
+        auto newest = openPages.rbegin();
+        auto pageCopies = copies.find(fileIndex);
+        if (fileIndex > newest->second
+                || (pageCopies != copies.end() && pageCopies->second.back().version >= newest->first)) {
+            return;
+        }
+
+        // Copies take pages which never held a node in this run and are
+        // free after a restart, so they are written without being logged
+        long copyIndex;
+        if (!freeCopies.empty()) {
+            copyIndex = freeCopies.back();
+            freeCopies.pop_back();
+        } else {
+            copyIndex = ++Node::fileCount;
+        }
+        vector<char> image(treeFile->getPageSize());
+        treeFile->readPage(fileIndex, image.data());
+        treeFile->writePage(copyIndex, image.data());
+
+        copies[fileIndex].push_back({newest->first, copyIndex});
+    }
+
+    const char *SnapshotTable::page(long version, long fileIndex) {
+        {
+            lock_guard<mutex> guard(access);
+            auto pageCopies = copies.find(fileIndex);
+            if (pageCopies != copies.end()) {
+                for (auto &copy : pageCopies->second) {
+                    if (copy.version >= version) {
+                        return treeFile->mappedPage(copy.copyIndex);
+                    }
+                }
+            }
+        }
+
+        return treeFile->mappedPage(fileIndex);
+    }
+
+    void SnapshotTable::freePage(long fileIndex) {
+        {
+            lock_guard<mutex> guard(access);
+
+            // Pages made since the newest snapshot was taken are in none
+            if (!openPages.empty() && fileIndex <= openPages.rbegin()->second) {
+                retired.push_back({openPages.rbegin()->first, fileIndex});
+                return;
+            }
+        }
+
+        Node::freeFileIndex(fileIndex);
+    }
+
+    vector<long> SnapshotTable::heldPages() {
+        lock_guard<mutex> guard(access);
+        vector<long> pages = freeCopies;
+        for (auto &pageCopies : copies) {
+            for (auto &copy : pageCopies.second) {
+                pages.push_back(copy.copyIndex);
+            }
+        }
+        for (auto &page : retired) {
+            pages.push_back(page.fileIndex);
+        }
+        return pages;
+    }
+
+    // Cache of the nodes in memory, nodes are written back when evicted. When
+    // running concurrently, writers write back their nodes before unlatching
+    // them so that readers find the latest changes in the pages.
+    class BufferPool {
+        private:
+            struct Frame {
+                Node *node;
+                long pinCount;
+                bool dirty;
+                list<long>::iterator position;  // Position in the LRU list
+            };
+
+            long capacity;
+            unordered_map<long, Frame> frames;
+            list<long> recentlyUsed;            // Most recently used in front
+            mutex access;                       // Guards the frames
+
+            // Evict unpinned nodes till we are within capacity
+            void evict();
+
+        public:
+            BufferPool(long _capacity) : capacity(_capacity) {}
+            ~BufferPool();
+
+            // Get the node with the given fileIndex, pinned
+            Node *fetch(long fileIndex);
+
+            // Get the node with the given fileIndex, pinned and latched
+            // exclusive for changing it
+            Node *fetchExclusive(long fileIndex);
+
+            // Create a new node, pinned and latched exclusive
+            Node *create();
+
+            // Unpin a node obtained from the pool
+            void release(Node *node);
+
+            // Drop a node which is no longer in the tree and free its page,
+            // the node is pinned by the caller
+            void discard(Node *node);
+
+            // Write back a node which is being changed, so that readers
+            // find the change before the node is unlatched
+            void publish(Node *node);
+
+            // Unlatch and unpin a node obtained for changing it
+            void releaseExclusive(Node *node);
+
+            // Mark a node to be written back
+            void markDirty(Node *node);
+
+            // Write back the node if it is cached and dirty
+            void writeBack(long fileIndex);
+
+            // Write back all the dirty nodes
+            void flush();
+    };
+
+    BufferPool *bufferPool = nullptr;
+    Node *bRoot = nullptr;
+    atomic<long> rootIndex(DEFAULT_LOCATION);   // Where readers start
+
+    BufferPool::~BufferPool() {
+        flush();
+
+        // Clean up all the nodes
+        for (auto &frame : frames) {
+            delete frame.second.node;
+        }
+    }
+
+    Node *BufferPool::fetch(long fileIndex) {
+        lock_guard<mutex> guard(access);
+        auto frame = frames.find(fileIndex);
+
+        // Load the node from disk if it is not cached
+        if (frame == frames.end()) {
+            counters.add(CACHE_MISSES);
+            evict();
+
+            recentlyUsed.push_front(fileIndex);
+            Frame newFrame = {new Node(fileIndex), 0, false, recentlyUsed.begin()};
+            frame = frames.insert(make_pair(fileIndex, newFrame)).first;
+        } else {
+            counters.add(CACHE_HITS);
+            recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, frame->second.position);
+        }
+
+        frame->second.pinCount++;
+        return frame->second.node;
+    }
+
+    Node *BufferPool::fetchExclusive(long fileIndex) {
+        Node *node = fetch(fileIndex);
+        latchExclusive(fileIndex);
+        return node;
+    }
+
+    Node *BufferPool::create() {
+        Node *node;
+        {
+            lock_guard<mutex> guard(access);
+            evict();
+
+            // New nodes have to be written to disk at some point, a reused
+            // page is logged before it is first changed
+            node = new Node();
+            writeAheadLog->journalPage(node->getFileIndex());
+            recentlyUsed.push_front(node->getFileIndex());
+            Frame newFrame = {node, 1, true, recentlyUsed.begin()};
+            frames.insert(make_pair(node->getFileIndex(), newFrame));
+        }
+
+        // Nobody can reach the node till it is linked into the tree, so its
+        // latch is always free
+        if (concurrent) {
+            latchTable->tryLockExclusive(node->getFileIndex());
+        }
+        return node;
+    }
+
+    void BufferPool::release(Node *node) {
+        lock_guard<mutex> guard(access);
+        frames[node->getFileIndex()].pinCount--;
+    }
+
+    void BufferPool::discard(Node *node) {
+        long fileIndex = node->getFileIndex();
+        {
+            lock_guard<mutex> guard(access);
+            auto frame = frames.find(fileIndex);
+            recentlyUsed.erase(frame->second.position);
+            frames.erase(frame);
+            delete node;
+        }
+
+        snapshotTable->freePage(fileIndex);
+    }
+
+    void BufferPool::publish(Node *node) {
+        if (concurrent || writeThrough) {
+            writeBack(node->getFileIndex());
+        }
+    }
+
+    void BufferPool::releaseExclusive(Node *node) {
+        publish(node);
+        unlatch(node->getFileIndex());
+        release(node);
+    }
+
+    void BufferPool::markDirty(Node *node) {
+        lock_guard<mutex> guard(access);
+        frames[node->getFileIndex()].dirty = true;
+    }
+
+    void BufferPool::writeBack(long fileIndex) {
+        lock_guard<mutex> guard(access);
+        auto frame = frames.find(fileIndex);
+        if (frame != frames.end() && frame->second.dirty) {
+            frame->second.node->writeToDisk();
+            frame->second.dirty = false;
+        }
+    }
+
+    void BufferPool::evict() {
+        // Walk from the least recently used end, skipping pinned nodes
+        auto position = recentlyUsed.end();
+        while ((long) frames.size() >= capacity && position != recentlyUsed.begin()) {
+            --position;
+            Frame &frame = frames[*position];
+            if (frame.pinCount > 0) {
+                continue;
+            }
+
+            // Write back before dropping the node
+            if (frame.dirty) {
+                frame.node->writeToDisk();
+            }
+            delete frame.node;
+            counters.add(EVICTIONS);
+
+            frames.erase(*position);
+            position = recentlyUsed.erase(position);
+        }
+    }
+
+    void BufferPool::flush() {
+        lock_guard<mutex> guard(access);
+        for (auto &frame : frames) {
+            if (frame.second.dirty) {
+                frame.second.node->writeToDisk();
+                frame.second.dirty = false;
+            }
+        }
+    }
+
+    // Make node the root in place of the previous one, the root is kept
+    // pinned in the pool
+    void setRoot(Node *node) {
+        if (bRoot != nullptr && bRoot != node) {
+            bufferPool->release(bRoot);
+        }
+        bRoot = node;
+        rootIndex = node->getFileIndex();
+    }
+
+    // A point in time view of the tree. While a snapshot is open the queries
+    // on the thread which took it read the tree as it was then, while
+    // writers go on changing it.
+    class Snapshot {
+        private:
+            Snapshot *previous;                 // Open on the thread before
+
+        public:
+            long version;
+            long root;                          // Root when it was taken
+
+            Snapshot();
+            ~Snapshot();
+
+            Snapshot(const Snapshot &) = delete;
+            Snapshot &operator=(const Snapshot &) = delete;
+    };
+
+    thread_local Snapshot *currentSnapshot = nullptr;
+
+    Snapshot::Snapshot() {
+        // Concurrent writers write back their nodes as they change them. On
+        // a single thread the nodes in the pool are written back once, and
+        // writers write back from then on.
+        if (!concurrent && !writeThrough) {
+            bufferPool->flush();
+            writeThrough = true;
+        }
+
+        // Only the page writes in flight are waited for. A new root is
+        // written before it is published and the old one links to its
+        // split, so either is a root of the pages as of now.
+        snapshotTable->lockWrites();
+        version = snapshotTable->open();
+        root = rootIndex;
+        snapshotTable->unlockWrites();
+
+        previous = currentSnapshot;
+        currentSnapshot = this;
+    }
+
+    Snapshot::~Snapshot() {
+        currentSnapshot = previous;
+        snapshotTable->close(version);
+    }
+
+    // Return the root readers start from
+    long currentRoot() { return currentSnapshot != nullptr ? currentSnapshot->root : rootIndex.load(); }
+
+    // Check if readers copy the pages they read, as writers may change them
+    // while they are read
+    bool copiesPages() { return concurrent || currentSnapshot != nullptr; }
+
+    // Read only view of a node which reads the keys and pointers in place
+    // from its mapped page. Queries use views, modifications go through Node.
+    class NodeView {
+        private:
+            const char *page;
+            const char *keyData;                // Keys as laid out by KeyFormat
+            const long *pointers;               // childIndices or objectPointers
+            long count;                         // Number of keys
+            long valueStart;                    // Offset of the values of a leaf
+
+            // Read a field of the header
+            long field(PageOffset offset) { return *(const long *) (page + offset); }
+
+        public:
+            NodeView() : page(nullptr), keyData(nullptr), pointers(nullptr), count(0), valueStart(0) {}
+            NodeView(const char *_page) : page(_page) {
+                // A reader may look at a page while it is being written, the
+                // count is kept within the page till the reader validates it
+                count = min(max(field(NUM_KEYS_OFFSET), 0L), Node::upperBound);
+                KeyFormat<Key>::locate(page, count, keyData, pointers);
+                valueStart = isLeaf() ? valueOffset(page, count) : 0;
+            }
+
+            // Return the offset of the values of a leaf with count keys,
+            // right after its keys and pointers
+            static long valueOffset(const char *page, long count) {
+                const char *keyData;
+                const long *pointers;
+                KeyFormat<Key>::locate(page, count, keyData, pointers);
+                return min(KeyFormat<Key>::usedSize(page, keyData, count), Node::pageSize);
+            }
+
+            // Check if leaf
+            bool isLeaf() { return *(const bool *) (page + LEAF_OFFSET); }
+
+            // Get the fileIndex
+            long getFileIndex() { return field(FILE_INDEX_OFFSET); }
+
+            // Get the leaves on either side
+            long nextLeafIndex() { return field(NEXT_LEAF_OFFSET); }
+            long previousLeafIndex() { return field(PREVIOUS_LEAF_OFFSET); }
+
+            // Get the node to the right on the same level, and the largest
+            // key which can be in this node
+            long rightLinkIndex() { return isLeaf() ? nextLeafIndex() : field(RIGHT_LINK_OFFSET); }
+            Key highKey() { return KeyFormat<Key>::highKey(page, keyData, count); }
+
+            // Return the size of keys
+            long size() { return count; }
+
+            // Return the bytes of the page in use
+            long usedSize() {
+                return isLeaf() ? min(valueStart + count * inlineValueSize, Node::pageSize)
+                    : KeyFormat<Key>::usedSize(page, keyData, count);
+            }
+
+            // Access the keys and pointers
+            Key key(long i) { return KeyFormat<Key>::key(page, keyData, count, i); }
+            long childIndex(long i) { return pointers[i]; }
+            long objectPointer(long i) { return pointers[i]; }
+
+            // Return the value kept in a leaf for the entry at position i
+            string value(long i) {
+                long offset = valueStart + i * inlineValueSize;
+                if (offset + inlineValueSize > Node::pageSize) {
+                    return string();
+                }
+                return string(page + offset, min(DBObject::inlineLength(pointers[i]), inlineValueSize));
+            }
+
+            // Return the object of the entry at position i of a leaf, whose
+            // string is read from the object store only once it is asked for
+            DBObject object(long i) {
+                if (DBObject::isInline(pointers[i])) {
+                    return DBObject(key(i), pointers[i], value(i));
+                }
+                return DBObject(key(i), pointers[i]);
+            }
+
+            // Check if the entry at position of a leaf has been removed
+            bool isRemoved(long i) { return pointers[i] < 0; }
+
+            // Return the position of a key in keys
+            long getKeyPosition(const Key &key) { return KeyFormat<Key>::searchPage(page, keyData, count, key); }
+    };
+
+    // Get a view of the node with the given fileIndex
+    NodeView viewNode(long fileIndex) {
+        // Snapshots read the pages as they were
+        if (currentSnapshot != nullptr) {
+            counters.add(NODE_VIEWS);
+            return NodeView(snapshotTable->page(currentSnapshot->version, fileIndex));
+        }
+
+        // The page on disk has to have the latest changes, concurrent writers
+        // have written them back already
+        if (!concurrent) {
+            bufferPool->writeBack(fileIndex);
+        }
+        counters.add(NODE_VIEWS);
+        return NodeView(treeFile->mappedPage(fileIndex));
+    }
+
+    // Get a view of the node with the given fileIndex which stays the same
+    // while writers change the node. When running concurrently or on a
+    // snapshot the page is copied into buffer, and copied again if a writer
+    // changed it meanwhile.
+    NodeView readNode(long fileIndex, vector<char> &buffer) {
+        if (!copiesPages()) {
+            return viewNode(fileIndex);
+        }
+
+        counters.add(NODE_VIEWS);
+        buffer.resize(Node::pageSize);
+        while (true) {
+            // A writer copies a page for the snapshots before it writes it
+            unsigned long version = latchTable->readVersion(fileIndex);
+            const char *page = currentSnapshot != nullptr
+                ? snapshotTable->page(currentSnapshot->version, fileIndex) : treeFile->mappedPage(fileIndex);
+
+            // Only the header, keys and pointers in use are copied
+            memcpy(buffer.data(), page, NodeView(page).usedSize());
+
+            if (latchTable->validate(fileIndex, version)) {
+                return NodeView(buffer.data());
+            }
+        }
+    }
+
+    Node::Node() {
+        // Initially all the fileNames are DEFAULT_LOCATION
+        nextLeafIndex = DEFAULT_LOCATION;
+        previousLeafIndex = DEFAULT_LOCATION;
+        rightLinkIndex = DEFAULT_LOCATION;
+
+        // Nothing is to the right of a new node
+        highKey = KeyFormat<Key>::infinity();
+
+        // Initially every node is a leaf
+        leaf = true;
+
+        // Exit if the lowerBoundKey is not defined
+        if (lowerBound == 0) {
+            cout << "LowerKeyBound not defined";
+            exit(1);
+        }
+
+        // LeafNode properties
+        fileIndex = allocateFileIndex();
+    }
+
+    long Node::allocateFileIndex() {
+        // Reuse a free page before growing the file
+        {
+            lock_guard<mutex> guard(freeAccess);
+            if (!freeFileIndices.empty()) {
+                long fileIndex = freeFileIndices.back();
+                freeFileIndices.pop_back();
+                return fileIndex;
+            }
+        }
+
+        return ++fileCount;
+    }
+
+    void Node::freeFileIndex(long fileIndex) {
+        lock_guard<mutex> guard(freeAccess);
+        freeFileIndices.push_back(fileIndex);
+    }
+
+    Node::Node(long _fileIndex) {
+        // Exit if the lowerBoundKey is not defined
+        if (lowerBound == 0) {
+            cout << "LowerKeyBound not defined";
+            exit(1);
+        }
+
+        // Load the current node from disk
+        fileIndex = _fileIndex;
+        readFromDisk();
+    }
+
+    void Node::initialize() {
+        // Read in the pageSize from the configuration file
+        ifstream configFile;
+        configFile.open(CONFIG_FILE);
+        configFile >> pageSize;
+
+        // The pageSize is followed by name value pairs
+        string name;
+        double value;
+        while (configFile >> name >> value) {
+            options[name] = value;
+        }
+
+        // Save some place in the file for the header
+        long headerSize = KEYS_OFFSET;
+        pageSize = pageSize - headerSize;
+
+        // Compute parameters. Fixed size keys are counted, variable size keys
+        // are given the bytes they need and a page holds the most of them
+        // when they are empty.
+        long nodeSize = sizeof(fileIndex);
+        if (KeyFormat<Key>::fixedSize) {
+            long keySize = sizeof(Key);
+            lowerBound = floor((pageSize - nodeSize) / (2 * (keySize + nodeSize)));
+            upperBound = 2 * lowerBound;
+            capacity = upperBound;
+        } else {
+            long offsetSize = sizeof(int);
+            upperBound = (pageSize - nodeSize - offsetSize) / (nodeSize + offsetSize);
+            lowerBound = upperBound / 2;
+            capacity = pageSize;
+        }
+        pageSize = pageSize + headerSize;
+
+        // Every leaf has a slot for a value per key, a slot takes at most
+        // a sixteenth of the page
+        inlineValueSize = getOption("inlineValueSize", 0);
+        inlineValueSize = max(0L, min(inlineValueSize, min((long) MAX_INLINE_VALUE_SIZE, (pageSize - headerSize) / 16)));
+        KeyFormat<Key>::initialize(pageSize, inlineValueSize);
+        selectPageLayout();
+
+        // Fixed size keys are counted, leaves fit fewer of them with their
+        // values. Variable size keys count the values with their bytes.
+        leafCapacity = capacity;
+        if (KeyFormat<Key>::fixedSize && inlineValueSize > 0) {
+            long entrySize = sizeof(Key) + nodeSize + inlineValueSize;
+            leafCapacity = 2 * ((pageSize - headerSize - nodeSize) / (2 * entrySize));
+        }
+
+        // Open the file which holds all the pages
+        treeFile = new PageFile(TREE_FILE, pageSize);
+
+        // Setup the cache of nodes
+        bufferPool = new BufferPool(getOption("bufferPoolSize", DEFAULT_BUFFER_POOL_SIZE));
+
+        // Every page the mapping can hold gets a latch
+        latchTable = new LatchTable(MAPPING_SIZE / pageSize);
+
+        // Pages are copied for the snapshots before they are written
+        snapshotTable = new SnapshotTable();
+
+        // Open the log of the changes since the last checkpoint
+        writeAheadLog = new WriteAheadLog(LOG_FILE, getOption("logGroupSize", DEFAULT_LOG_GROUP_SIZE),
+                getOption("checkpointInterval", DEFAULT_CHECKPOINT_INTERVAL));
+    }
+
+    void Node::selectPageLayout() {
+#ifndef STRING_KEYS
+        if (pageSize == 4096) {
+            usePageLayout< PageLayout<Key, long, 4096> >();
+        } else if (pageSize == 16384) {
+            usePageLayout< PageLayout<Key, long, 16384> >();
+        } else if (pageSize == 65536) {
+            usePageLayout< PageLayout<Key, long, 65536> >();
+        }
+#endif
+    }
+
+#ifndef STRING_KEYS
+    template<typename Layout>
+    void Node::usePageLayout() {
+        lowerBound = Layout::lowerBound;
+        upperBound = Layout::upperBound;
+        capacity = upperBound;
+        KeyFormat<Key>::kernel = Layout::selectSearch();
+        pageWriter = &Node::writePage<Layout::pageSize>;
+        pageReader = &Node::readPage<Layout::pageSize>;
+    }
+#endif
+
+    // A buffer for a page, on the stack for a page size known at compile
+    // time and on the heap otherwise
+    template<long PageSize>
+        struct PageBuffer {
+            alignas(long) char bytes[PageSize];
+            char *data() { return bytes; }
+        };
+
+    template<>
+        struct PageBuffer<0> {
+            vector<char> bytes;
+            PageBuffer() : bytes(Node::pageSize) {}
+            char *data() { return bytes.data(); }
+        };
+
+    template<long PageSize>
+    void Node::writePage() {
+        PageBuffer<PageSize> buffer;
+        writeToDisk(buffer.data());
+    }
+
+    template<long PageSize>
+    void Node::readPage() {
+        PageBuffer<PageSize> buffer;
+        readFromDisk(buffer.data());
+    }
+
+    long Node::getKeyPosition(const Key &key) {
+        return KeyFormat<Key>::search(keys, key);
+    }
+
+    void Node::commitToDisk() {
+        writeAheadLog->journalPage(fileIndex);
+        bufferPool->markDirty(this);
+    }
+
+    void Node::writeToDisk(char *buffer) {
+        // The buffer is filled and written to disk
+        long location = 0;
+
+        // Store the fileIndex
+        memcpy(buffer + location, &fileIndex, sizeof(fileIndex));
+        location += sizeof(fileIndex);
+
+        // Add the previous leaf node
+        memcpy(buffer + location, &previousLeafIndex, sizeof(nextLeafIndex));
+        location += sizeof(nextLeafIndex);
+
+        // Add the next leaf node
+        memcpy(buffer + location, &nextLeafIndex, sizeof(nextLeafIndex));
+        location += sizeof(nextLeafIndex);
+
+        // Add the right link
+        memcpy(buffer + location, &rightLinkIndex, sizeof(rightLinkIndex));
+        location += sizeof(rightLinkIndex);
+
+        // The high key is added with the keys
+        location += sizeof(long);
+
+        // Store the number of keys
+        long numKeys = keys.size();
+        memcpy(buffer + location, &numKeys, sizeof(numKeys));
+        location += sizeof(numKeys);
+
+        // Add the leaf to memory
+        memcpy(buffer + location, &leaf, sizeof(leaf));
+
+        // Add the high key, keys and pointers
+        KeyFormat<Key>::write(buffer, keys, leaf ? objectPointers : childIndices, highKey);
+
+        // Add the values kept in a leaf after them, a slot per key
+        if (leaf && inlineValueSize > 0) {
+            char *valueData = buffer + NodeView::valueOffset(buffer, numKeys);
+            for (long i = 0; i < numKeys; ++i) {
+                memcpy(valueData + i * inlineValueSize, values[i].data(), values[i].size());
+            }
+        }
+
+        // Write the page into the tree file once the log allows it and the
+        // open snapshots have a copy, readers which copied the page
+        // meanwhile see the version change
+        writeAheadLog->beforeWrite(fileIndex);
+        snapshotTable->beginWrite(fileIndex);
+        latchTable->beginWrite(fileIndex);
+        treeFile->writePage(fileIndex, buffer);
+        latchTable->endWrite(fileIndex);
+        snapshotTable->endWrite();
+    }
+
+    void Node::readFromDisk(char *buffer) {
+        // The page is read into the buffer
+        long location = 0;
+
+        // Read the page from the tree file
+        treeFile->readPage(fileIndex, buffer);
+
+        // Retrieve the fileIndex
+        memcpy((char *) &fileIndex, buffer + location, sizeof(fileIndex));
+        location += sizeof(fileIndex);
+
+        // Retrieve the previousLeafIndex
+        memcpy((char *) &previousLeafIndex, buffer + location, sizeof(previousLeafIndex));
+        location += sizeof(previousLeafIndex);
+
+        // Retrieve the nextLeafIndex
+        memcpy((char *) &nextLeafIndex, buffer + location, sizeof(nextLeafIndex));
+        location += sizeof(nextLeafIndex);
+
+        // Retrieve the rightLinkIndex
+        memcpy((char *) &rightLinkIndex, buffer + location, sizeof(rightLinkIndex));
+        location += sizeof(rightLinkIndex);
+
+        // The highKey is retrieved with the keys
+        location += sizeof(long);
+
+        // Retrieve the number of keys
+        long numKeys;
+        memcpy((char *) &numKeys, buffer + location, sizeof(numKeys));
+        location += sizeof(numKeys);
+
+        // Retreive the type of node
+        memcpy((char *) &leaf, buffer + location, sizeof(leaf));
+
+        // Retrieve the highKey, keys and pointers
+        KeyFormat<Key>::read(buffer, numKeys, leaf, keys, leaf ? objectPointers : childIndices, highKey);
+
+        // Retrieve the values kept in a leaf
+        if (leaf) {
+            NodeView view(buffer);
+            values.assign(numKeys, string());
+            for (long i = 0; i < numKeys && inlineValueSize > 0; ++i) {
+                if (DBObject::isInline(objectPointers[i])) {
+                    values[i] = view.value(i);
+                }
+            }
+        }
+    }
+
+    void Node::printNode() {
+        cout << endl << endl;
+
+        cout << "File : " << fileIndex << endl;
+        cout << "IsLeaf : " << leaf << endl;
+        cout << "PreviousLeaf : " << previousLeafIndex << endl;
+        cout << "NextLeaf : " << nextLeafIndex << endl;
+        cout << "RightLink : " << rightLinkIndex << endl;
+        cout << "HighKey : " << highKey << endl;
+
+        // Print keys
+        cout << "Keys : ";
+        for (auto key : keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+
+        // Print the name of the child
+        cout << "Children : ";
+        for (auto childIndex : childIndices) {
+            cout << childIndex << " ";
+        }
+        cout << endl;
+    }
+
+    void Node::insertObject(DBObject object) {
+        long position = getKeyPosition(object.getKey());
+
+        // insert the new key to keys
+        keys.insert(keys.begin() + position, object.getKey());
+
+        // insert the object pointer to the end
+        objectPointers.insert(objectPointers.begin() + position, object.getFileIndex());
+
+        // Keep the string with them if it is not in the object store
+        values.insert(values.begin() + position,
+                DBObject::isInline(object.getFileIndex()) ? object.getDataString() : string());
+
+        // Commit the new node back into memory
+        commitToDisk();
+    }
+
+    long Node::purge() {
+        long kept = 0;
+        for (long i = 0; i < (long) keys.size(); ++i) {
+            if (!isRemoved(i)) {
+                keys[kept] = keys[i];
+                objectPointers[kept] = objectPointers[i];
+                values[kept] = values[i];
+                kept++;
+            }
+        }
+
+        long removed = keys.size() - kept;
+        if (removed > 0) {
+            keys.resize(kept);
+            objectPointers.resize(kept);
+            values.resize(kept);
+            commitToDisk();
+        }
+
+        return removed;
+    }
+
+    bool Node::mergeChildren(long position) {
+        Node *left = bufferPool->fetch(childIndices[position]);
+        Node *right = bufferPool->fetch(childIndices[position + 1]);
+        Key separator = keys[position];
+
+        // Internal nodes take the separator down between their keys
+        vector<Key> allKeys(left->keys);
+        if (!left->isLeaf()) {
+            allKeys.push_back(separator);
+        }
+        allKeys.insert(allKeys.end(), right->keys.begin(), right->keys.end());
+
+        vector<long> allPointers(left->isLeaf() ? left->objectPointers : left->childIndices);
+        vector<long> &rightPointers = right->isLeaf() ? right->objectPointers : right->childIndices;
+        allPointers.insert(allPointers.end(), rightPointers.begin(), rightPointers.end());
+        vector<string> allValues(left->values);
+        allValues.insert(allValues.end(), right->values.begin(), right->values.end());
+
+        bool merged = KeyFormat<Key>::space(allKeys, right->highKey, left->isLeaf()) <= left->room();
+        if (merged) {
+            // The left node takes over everything, and the place of the
+            // right one in the links
+            left->keys = allKeys;
+            (left->isLeaf() ? left->objectPointers : left->childIndices) = allPointers;
+            left->values = allValues;
+            left->highKey = right->highKey;
+            left->rightLinkIndex = right->rightLinkIndex;
+
+            if (left->isLeaf()) {
+                left->nextLeafIndex = right->nextLeafIndex;
+                if (right->nextLeafIndex != DEFAULT_LOCATION) {
+                    Node *nextLeaf = bufferPool->fetch(right->nextLeafIndex);
+                    nextLeaf->previousLeafIndex = left->fileIndex;
+                    nextLeaf->commitToDisk();
+                    bufferPool->release(nextLeaf);
+                }
+            }
+
+            keys.erase(keys.begin() + position);
+            childIndices.erase(childIndices.begin() + position + 1);
+            bufferPool->discard(right);
+        } else {
+            // Split the entries evenly, as a split of the merged node would.
+            // The new separator may be longer than the one it replaces, the
+            // entries are left where they are if it does not fit.
+            long leftSize = KeyFormat<Key>::splitPosition(allKeys, right->highKey, left->isLeaf());
+            keys[position] = left->isLeaf()
+                ? KeyFormat<Key>::separator(allKeys[leftSize - 1], allKeys[leftSize]) : allKeys[leftSize];
+            if (overflows()) {
+                keys[position] = separator;
+                bufferPool->release(right);
+                bufferPool->release(left);
+                return false;
+            }
+            separator = keys[position];
+
+            if (left->isLeaf()) {
+                left->keys.assign(allKeys.begin(), allKeys.begin() + leftSize);
+                left->objectPointers.assign(allPointers.begin(), allPointers.begin() + leftSize);
+                left->values.assign(allValues.begin(), allValues.begin() + leftSize);
+                right->keys.assign(allKeys.begin() + leftSize, allKeys.end());
+                right->objectPointers.assign(allPointers.begin() + leftSize, allPointers.end());
+                right->values.assign(allValues.begin() + leftSize, allValues.end());
+            } else {
+                left->keys.assign(allKeys.begin(), allKeys.begin() + leftSize);
+                left->childIndices.assign(allPointers.begin(), allPointers.begin() + leftSize + 1);
+                right->keys.assign(allKeys.begin() + leftSize + 1, allKeys.end());
+                right->childIndices.assign(allPointers.begin() + leftSize + 1, allPointers.end());
+            }
+
+            left->highKey = separator;
+            right->commitToDisk();
+            bufferPool->release(right);
+        }
+
+        left->commitToDisk();
+        bufferPool->release(left);
+        commitToDisk();
+
+        return merged;
+    }
+
+    void Node::serialize() {
+        // Return if node is empty
+        if (keys.size() == 0) {
+            return;
+        }
+
+        // Prettify
+        cout << endl << endl;
+
+        queue< pair<long, char> > previousLevel;
+        previousLevel.push(make_pair(fileIndex, 'N'));
+
+        long currentIndex;
+        Node *iterator;
+        char type;
+        while (!previousLevel.empty()) {
+            queue< pair<long, char> > nextLevel;
+
+            while (!previousLevel.empty()) {
+                // Get the front and pop
+                currentIndex = previousLevel.front().first;
+                type = previousLevel.front().second;
+                previousLevel.pop();
+
+                // If it a seperator, print and move ahead
+                if (type == '|') {
+                    cout << "|| ";
+                    continue;
+                }
+
+                // Load the node
+                iterator = bufferPool->fetch(currentIndex);
+
+                // Print all the keys
+                for (auto key : iterator->keys) {
+                    cout << key << " ";
+                }
+
+                // Enqueue all the children
+                for (auto childIndex : iterator->childIndices) {
+                    nextLevel.push(make_pair(childIndex, 'N'));
+
+                    // Insert a marker to indicate end of child
+                    nextLevel.push(make_pair(DEFAULT_LOCATION, '|'));
+                }
+
+                // Release the node
+                bufferPool->release(iterator);
+            }
+
+            // Seperate different levels
+            cout << endl << endl;
+            previousLevel = nextLevel;
+        }
+    }
+
+    void Node::insertNode(const Key &key, long leftChildIndex, long rightChildIndex, vector<Node *> &path) {
+        // The new child goes right after the one it split from, a search for
+        // the key may land left of it when separators repeat
+        long position = find(childIndices.begin(), childIndices.end(), leftChildIndex) - childIndices.begin();
+        keys.insert(keys.begin() + position, key);
+
+        // insert the newChild
+        childIndices.insert(childIndices.begin() + position + 1, rightChildIndex);
+
+        // commit changes to disk
+        commitToDisk();
+
+#ifdef DEBUG_VERBOSE
+        cout << endl;
+        cout << "InsertNode : " << endl;
+        cout << "Base Node : ";
+        for (auto key : keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+
+        // Print them out
+        Node *leftChild = bufferPool->fetch(leftChildIndex);
+        cout << "LeftNode : ";
+        for (auto key : leftChild->keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+        bufferPool->release(leftChild);
+
+        Node *rightChild = bufferPool->fetch(rightChildIndex);
+        cout << "RightNode : ";
+        for (auto key : rightChild->keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+        bufferPool->release(rightChild);
+#endif
+
+        // If this overflows, we move again upward
+        if (overflows()) {
+            splitInternal(path);
+        }
+    }
+
+    // Level above the leaves of the node being split, a split moves up one
+    // level at a time starting from a leaf
+    thread_local long splitLevel = 0;
+
+    void Node::splitInternal(vector<Node *> &path) {
+        splitLevel = min(splitLevel + 1, SPLIT_LEVELS - 1L);
+        counters.add((Counter) (SPLITS + splitLevel));
+
+#ifdef DEBUG_VERBOSE
+        cout << endl;
+        cout << "SplitInternal : " << endl;
+        cout << "Base Node : ";
+        for (auto key : keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+#endif
+
+        // Create a surrogate internal node
+        Node *surrogateInternalNode = bufferPool->create();
+        surrogateInternalNode->setToInternalNode();
+
+        // Fix the keys of the new node
+        long middle = KeyFormat<Key>::splitPosition(keys, highKey, false);
+        Key startPoint = *(keys.begin() + middle);
+        for (auto key = keys.begin() + middle + 1; key != keys.end(); ++key) {
+            surrogateInternalNode->keys.push_back(*key);
+        }
+
+        // Resize the keys of the current node
+        keys.resize(middle);
+
+#ifdef DEBUG_VERBOSE
+        // Print them out
+        cout << "First InternalNode : ";
+        for (auto key : keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+
+        cout << "Second InternalNode : ";
+        for (auto key : surrogateInternalNode->keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+
+        cout << "Split At " << startPoint << endl;
+#endif
+
+        // Partition children for the surrogateInternalNode, they need not be
+        // touched since they do not point back to their parent
+        surrogateInternalNode->childIndices.assign(childIndices.begin() + middle + 1, childIndices.end());
+
+        // Fix children for the current node
+        childIndices.resize(middle + 1);
+
+        // The new node takes over the right end of the current one
+        surrogateInternalNode->rightLinkIndex = rightLinkIndex;
+        surrogateInternalNode->highKey = highKey;
+        rightLinkIndex = surrogateInternalNode->fileIndex;
+        highKey = startPoint;
+
+        // Publish the new node through the right link before the parent
+        // learns of it, readers coming from the parent move right to it
+        surrogateInternalNode->commitToDisk();
+        commitToDisk();
+        bufferPool->publish(surrogateInternalNode);
+        bufferPool->publish(this);
+
+        // If the current node is not a root node
+        if (!path.empty()) {
+            // Now we push up the splitting one level
+            Node *parent = path.back();
+            path.pop_back();
+            parent->insertNode(startPoint, fileIndex, surrogateInternalNode->fileIndex, path);
+            path.push_back(parent);
+        } else {
+            // Create a new parent node
+            Node *newParent = bufferPool->create();
+            newParent->setToInternalNode();
+
+            // Insert the key into the keys
+            newParent->keys.push_back(startPoint);
+
+            // Insert the children
+            newParent->childIndices.push_back(fileIndex);
+            newParent->childIndices.push_back(surrogateInternalNode->fileIndex);
+
+            // Commit changes to disk
+            newParent->commitToDisk();
+            bufferPool->publish(newParent);
+
+            // Pin the new root in place of the previous one
+            setRoot(bufferPool->fetch(newParent->getFileIndex()));
+            bufferPool->releaseExclusive(newParent);
+        }
+
+        // Release the surrogateInternalNode
+        bufferPool->releaseExclusive(surrogateInternalNode);
+    }
+
+    void Node::splitLeaf(vector<Node *> &path) {
+        splitLevel = 0;
+        counters.add(SPLITS);
+
+#ifdef DEBUG_VERBOSE
+        cout << endl;
+        cout << "SplitLeaf : " << endl;
+        cout << "Base Node : ";
+
+        for (auto key : keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+#endif
+
+        // Create a surrogate leaf node and move the upper half of the keys
+        // and object Pointers to it in one go
+        long middle = KeyFormat<Key>::splitPosition(keys, highKey, true);
+        Node *surrogateLeafNode = bufferPool->create();
+        surrogateLeafNode->keys.assign(keys.begin() + middle, keys.end());
+        surrogateLeafNode->objectPointers.assign(objectPointers.begin() + middle, objectPointers.end());
+        surrogateLeafNode->values.assign(values.begin() + middle, values.end());
+
+        // Resize the current leaf node and commit the node to disk
+        keys.resize(middle);
+        objectPointers.resize(middle);
+        values.resize(middle);
+
+#ifdef DEBUG_VERBOSE
+        // Print them out
+        cout << "First Leaf : ";
+        for (auto key : keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+
+        cout << "Second Leaf : ";
+        for (auto key : surrogateLeafNode->keys) {
+            cout << key << " ";
+        }
+        cout << endl;
+#endif
+
+        // Link up the leaves, the new leaf takes over the right end of the
+        // current one. The separator is cut down to the shortest key which
+        // tells the two leaves apart.
+        long tempLeafIndex = nextLeafIndex;
+        nextLeafIndex = surrogateLeafNode->fileIndex;
+        surrogateLeafNode->nextLeafIndex = tempLeafIndex;
+        surrogateLeafNode->previousLeafIndex = fileIndex;
+        Key separator = KeyFormat<Key>::separator(keys.back(), surrogateLeafNode->keys.front());
+        surrogateLeafNode->highKey = highKey;
+        highKey = separator;
+
+        // Publish the new leaf through the next leaf link before the parent
+        // learns of it, readers coming from the parent move right to it
+        surrogateLeafNode->commitToDisk();
+        commitToDisk();
+        bufferPool->publish(surrogateLeafNode);
+        bufferPool->publish(this);
+
+        // If the tempLeafIndex is not null we have to load it and set its
+        // previous index
+        if (tempLeafIndex != DEFAULT_LOCATION) {
+            Node *tempLeaf = bufferPool->fetchExclusive(tempLeafIndex);
+            tempLeaf->previousLeafIndex = surrogateLeafNode->fileIndex;
+            tempLeaf->commitToDisk();
+            bufferPool->releaseExclusive(tempLeaf);
+        }
+
+        // Consider the case when the current node is not a root
+        if (!path.empty()) {
+            // Now we push up the splitting one level
+            Node *parent = path.back();
+            path.pop_back();
+            parent->insertNode(separator, fileIndex, surrogateLeafNode->fileIndex, path);
+            path.push_back(parent);
+        } else {
+            // Create a new parent node
+            Node *newParent = bufferPool->create();
+            newParent->setToInternalNode();
+
+            // Insert the key into the keys
+            newParent->keys.push_back(separator);
+
+            // Insert the children
+            newParent->childIndices.push_back(this->fileIndex);
+            newParent->childIndices.push_back(surrogateLeafNode->fileIndex);
+
+            // Commit to disk
+            newParent->commitToDisk();
+            bufferPool->publish(newParent);
+
+            // Pin the new root in place of the previous one
+            setRoot(bufferPool->fetch(newParent->getFileIndex()));
+            bufferPool->releaseExclusive(newParent);
+        }
+
+        // Release the surrogateNode
+        bufferPool->releaseExclusive(surrogateLeafNode);
+    }
+
+    void storeSession();
+
+    // Removed entries which the next rebalance takes out, and their keys.
+    // Only the leaves holding these keys and the nodes above them are
+    // looked at.
+    atomic<long> pendingRemoves(0);
+    set<Key> removedKeys;
+    mutex removedAccess;                        // Guards removedKeys
+
+    // Insert a key into the BPlusTree without logging it. The path holds the
+    // ancestors which a split can reach, once a node has room for one more
+    // key the ones above it are let go.
+    void insertEntry(DBObject object) {
+        vector<Node *> path;
+
+        // A split of the root replaces it
+        latchExclusive(ROOT_LATCH);
+        bool rootLatched = true;
+        Node *node = bufferPool->fetchExclusive(rootIndex);
+
+        while (true) {
+            if (node->hasRoom()) {
+                for (auto ancestor : path) {
+                    bufferPool->releaseExclusive(ancestor);
+                }
+                path.clear();
+
+                if (rootLatched) {
+                    unlatch(ROOT_LATCH);
+                    rootLatched = false;
+                }
+            }
+
+            if (node->isLeaf()) {
+                break;
+            }
+
+            // We traverse the tree
+            long position = node->getKeyPosition(object.getKey());
+            path.push_back(node);
+            node = bufferPool->fetchExclusive(node->childIndices[position]);
+        }
+
+        // Insert object and split if required
+        node->insertObject(object);
+        if (node->overflows()) {
+            node->splitLeaf(path);
+        }
+
+#ifdef DEBUG_VERBOSE
+        // Serialize
+        bRoot->serialize();
+#endif
+
+        // Release the nodes
+        bufferPool->releaseExclusive(node);
+        for (auto ancestor : path) {
+            bufferPool->releaseExclusive(ancestor);
+        }
+        if (rootLatched) {
+            unlatch(ROOT_LATCH);
+        }
+    }
+
+    // Insert a key into the BPlusTree, and take a checkpoint when due. Keys
+    // which do not fit in a node are skipped.
+    void insert(DBObject object) {
+        if (!KeyFormat<Key>::validate(object.getKey())) {
+            return;
+        }
+
+        writeAheadLog->beginInsert(object.getKey(), object.getFileIndex(), object.getDataString());
+        insertEntry(object);
+        if (writeAheadLog->endChange()) {
+            storeSession();
+        }
+    }
+
+    // Mark the entries with the key as removed without logging it, only the
+    // one with objectPointer unless it is DEFAULT_LOCATION. Return the number
+    // of entries removed.
+    long removeEntry(const Key &key, long objectPointer) {
+        latchExclusive(ROOT_LATCH);
+        Node *node = bufferPool->fetchExclusive(rootIndex);
+        unlatch(ROOT_LATCH);
+
+        // Nothing splits, so a node is let go once its child is latched
+        while (!node->isLeaf()) {
+            Node *child = bufferPool->fetchExclusive(node->childIndices[node->getKeyPosition(key)]);
+            bufferPool->releaseExclusive(node);
+            node = child;
+        }
+
+        // The entries with the key may go on into the leaves on the right
+        long removed = 0;
+        long position = node->getKeyPosition(key);
+        while (true) {
+            bool changed = false;
+            for (; position < node->size() && node->keys[position] == key; ++position) {
+                if (!node->isRemoved(position)
+                        && (objectPointer == DEFAULT_LOCATION || node->objectPointers[position] == objectPointer)) {
+                    node->markRemoved(position);
+                    changed = true;
+                    removed++;
+                }
+            }
+            if (changed) {
+                node->commitToDisk();
+            }
+
+            bool done = position < node->size() || node->nextLeafIndex == DEFAULT_LOCATION
+                || (objectPointer != DEFAULT_LOCATION && removed > 0);
+            if (done) {
+                break;
+            }
+
+            // Latch the next leaf before letting go of this one, the entries
+            // with the key go on from where they start in it
+            Node *next = bufferPool->fetchExclusive(node->nextLeafIndex);
+            bufferPool->releaseExclusive(node);
+            node = next;
+            position = node->getKeyPosition(key);
+        }
+        bufferPool->releaseExclusive(node);
+
+        if (removed > 0) {
+            lock_guard<mutex> guard(removedAccess);
+            removedKeys.insert(key);
+        }
+        pendingRemoves += removed;
+        return removed;
+    }
+
+    // Remove the entries with the key, or only the one with objectPointer.
+    // Entries are only marked as removed, rebalance takes them out later.
+    long remove(const Key &key, long objectPointer = DEFAULT_LOCATION) {
+        writeAheadLog->beginRemove(key, objectPointer);
+        long removed = removeEntry(key, objectPointer);
+        if (writeAheadLog->endChange()) {
+            storeSession();
+        }
+
+        return removed;
+    }
+
+    // Take out the removed entries below node in the leaves which can hold
+    // one of the keys from begin to end, then merge or even out those of
+    // the children left less than half full. The keys are sorted.
+    void rebalanceNode(Node *node, vector<Key>::const_iterator begin, vector<Key>::const_iterator end) {
+        set<long> touched;
+        for (long i = 0; i < (long) node->childIndices.size() && begin != end; ++i) {
+            // Keys equal to a separator may be on either side of it
+            auto childEnd = i < node->size() ? upper_bound(begin, end, node->keys[i]) : end;
+            if (childEnd == begin) {
+                continue;
+            }
+
+            Node *child = bufferPool->fetch(node->childIndices[i]);
+            if (child->isLeaf()) {
+                child->purge();
+            } else {
+                rebalanceNode(child, begin, childEnd);
+            }
+            touched.insert(child->getFileIndex());
+            bufferPool->release(child);
+
+            begin = i < node->size() ? lower_bound(begin, childEnd, node->keys[i]) : childEnd;
+        }
+
+        long position = 0;
+        while (position < (long) node->childIndices.size() && node->childIndices.size() > 1) {
+            if (touched.count(node->childIndices[position]) == 0) {
+                ++position;
+                continue;
+            }
+
+            Node *child = bufferPool->fetch(node->childIndices[position]);
+            bool underfull = child->underflows();
+            bufferPool->release(child);
+
+            if (!underfull) {
+                ++position;
+                continue;
+            }
+
+            // Pair up with the right neighbour, or the left one for the last
+            // child. A merged node is looked at again.
+            long left = min(position, (long) node->childIndices.size() - 2);
+            if (node->mergeChildren(left)) {
+                touched.insert(node->childIndices[left]);
+                position = left;
+            } else {
+                position = left + 2;
+            }
+        }
+    }
+
+    // A root with a single child is not needed, the child takes its place
+    void shrinkRoot() {
+        Node *root = bufferPool->fetch(rootIndex);
+        while (!root->isLeaf() && root->childIndices.size() == 1) {
+            setRoot(bufferPool->fetch(root->childIndices.front()));
+            bufferPool->discard(root);
+            root = bufferPool->fetch(rootIndex);
+        }
+        bufferPool->release(root);
+    }
+
+    // Print the height of the tree and how full the pages of each level are,
+    // walking every level along the right links. The nodes in the pool are
+    // written back first so that the pages are current.
+    void printTreeShape(ostream &out) {
+        bufferPool->flush();
+
+        // Nodes, keys and bytes in use of each level from the root down
+        vector< vector<long> > levels;
+        for (long first = rootIndex; first != DEFAULT_LOCATION; ) {
+            vector<long> level(3, 0);
+            for (long index = first; index != DEFAULT_LOCATION; ) {
+                NodeView node = viewNode(index);
+                level[0]++;
+                level[1] += node.size();
+                level[2] += node.usedSize();
+                index = node.rightLinkIndex();
             }
+            levels.push_back(level);
+
+            NodeView node = viewNode(first);
+            first = node.isLeaf() ? DEFAULT_LOCATION : node.childIndex(0);
+        }
+
+        out << "Height " << levels.size() << endl;
+        for (long depth = (long) levels.size() - 1; depth >= 0; --depth) {
+            vector<long> &level = levels[depth];
+            out << "Level " << levels.size() - 1 - depth << ": " << level[0] << " nodes, "
+                << level[1] << " keys, " << 100.0 * level[2] / (level[0] * Node::pageSize) << "% full" << endl;
+        }
+    }
+
+    // Take out the removed entries and fix the nodes left with too few keys.
+    // Readers hold no latches and may be on any node, so this runs only
+    // when no queries are in flight.
+    void rebalance() {
+        pendingRemoves = 0;
+        vector<Key> keys;
+        {
+            lock_guard<mutex> guard(removedAccess);
+            keys.assign(removedKeys.begin(), removedKeys.end());
+            removedKeys.clear();
+        }
+
+        Node *root = bufferPool->fetch(rootIndex);
+        if (root->isLeaf()) {
+            root->purge();
         } else {
-            objectPointers.clear();
-            long objectPointer;
-            for (long i = 0; i < numKeys; ++i) {
-                memcpy((char *) &objectPointer, buffer + location, sizeof(objectPointer));
-                location += sizeof(objectPointer);
-                objectPointers.push_back(objectPointer);
+            rebalanceNode(root, keys.begin(), keys.end());
+        }
+        bufferPool->release(root);
+        shrinkRoot();
+
+        // Readers find the changes in the pages
+        if (concurrent || writeThrough) {
+            bufferPool->flush();
+        }
+    }
+
+    // Find the leaf in which key belongs, and the internal nodes and child
+    // positions on the way to it. Readers take no latches, when running
+    // concurrently a node is read in place and its version is checked before
+    // the next node is visited. A node which split after its parent was read
+    // sends the keys past its highKey to its right link.
+    long findLeaf(const Key &key, vector< pair<NodeView, long> > &path) {
+        long fileIndex = currentRoot();
+        while (true) {
+            unsigned long version = concurrent ? latchTable->readVersion(fileIndex) : 0;
+            NodeView node = viewNode(fileIndex);
+
+            // Move right past a split, or down to the child
+            bool right = key > node.highKey() && node.rightLinkIndex() != DEFAULT_LOCATION;
+            bool leaf = node.isLeaf();
+            long position = right || leaf ? 0 : node.getKeyPosition(key);
+            long nextIndex = right ? node.rightLinkIndex() : leaf ? fileIndex : node.childIndex(position);
+
+            // Read the node again if a writer changed it meanwhile
+            if (concurrent && !latchTable->validate(fileIndex, version)) {
+                continue;
+            }
+
+            if (!right) {
+                if (leaf) {
+                    return fileIndex;
+                }
+                path.push_back(make_pair(node, position));
             }
+            fileIndex = nextIndex;
         }
     }
 
-    void Node::printNode() {
-        cout << endl << endl;
+    // Cursor over the entries of the leaves with keys within limits, moving
+    // forward or backward in key order. While a leaf is consumed, the next few
+    // leaves in the direction of the scan are read ahead. They are found by
+    // walking the internal nodes above the leaves, so the leaf chain need not
+    // be loaded to know which leaves come next.
+    class Cursor {
+        private:
+            NodeView leaf;
+            vector<char> copy;                  // Copy of leaf when concurrent
+            vector< vector<char> > copies;      // Copies of path when concurrent
+            long position;
+            Key lowerLimit;
+            Key upperLimit;
+            bool forward;                       // Direction of the scan
+            long readahead;                     // Leaves to read ahead
+            long consumed;                      // Leaves moved over since the
+                                                // last ones were read ahead
+
+            // Internal nodes and child positions leading to the last leaf
+            // read ahead, empty once there is nothing left to read ahead
+            vector< pair<NodeView, long> > path;
+
+            // Return the leaf after the last one read ahead, DEFAULT_LOCATION
+            // if there is nothing left to read ahead
+            long nextAhead();
+
+            // Read ahead the count leaves after the last one, all at once
+            void readAhead(long count);
+
+            // Count a leaf moved over, the leaves read ahead are topped up
+            // once half of them are consumed
+            void consume();
+
+            // Move over leaves which have been consumed
+            void settle();
+
+            // Move to the leaf with the given fileIndex
+            void load(long leafIndex);
 
-        cout << "File : " << fileIndex << endl;
-        cout << "IsLeaf : " << leaf << endl;
-        cout << "Parent : " << parentIndex << endl;
-        cout << "PreviousLeaf : " << previousLeafIndex << endl;
-        cout << "NextLeaf : " << nextLeafIndex << endl;
+        public:
+            Cursor(Key _lowerLimit, Key _upperLimit, bool _forward = true, long _readahead = -1)
+                : position(0), lowerLimit(_lowerLimit), upperLimit(_upperLimit),
+                forward(_forward), readahead(_readahead), consumed(0) {
+                if (readahead < 0) {
+                    readahead = getOption("readahead", DEFAULT_READAHEAD);
+                }
+            }
 
-        // Print keys
-        cout << "Keys : ";
-        for (auto key : keys) {
-            cout << key << " ";
-        }
-        cout << endl;
+            // Move to the first entry whose key is not less than key, or
+            // for a backward cursor to the last entry whose key is less
+            void seek(const Key &key);
 
-        // Print the name of the child
-        cout << "Children : ";
-        for (auto childIndex : childIndices) {
-            cout << childIndex << " ";
+            // Same as seek, for a key whose leaf has been found already
+            // through path
+            void start(const vector< pair<NodeView, long> > &_path, long leafIndex, const Key &key);
+
+            // Check if the cursor is at an entry within the limits
+            bool valid() {
+                if (position < 0 || position >= leaf.size()) {
+                    return false;
+                }
+                Key current = leaf.key(position);
+                return current >= lowerLimit && current <= upperLimit;
+            }
+
+            // Move to the next entry in the direction of the scan
+            void next() { position += forward ? 1 : -1; settle(); }
+
+            // Access the current entry
+            Key key() { return leaf.key(position); }
+            long objectPointer() { return leaf.objectPointer(position); }
+            DBObject object() { return leaf.object(position); }
+    };
+
+    void Cursor::seek(const Key &key) {
+        vector< pair<NodeView, long> > descent;
+        long leafIndex = findLeaf(key, descent);
+        start(descent, leafIndex, key);
+    }
+
+    void Cursor::start(const vector< pair<NodeView, long> > &_path, long leafIndex, const Key &key) {
+        path = _path;
+        copies.resize(path.size());
+
+        // The leaf may have split since it was found, the keys past its
+        // highKey have moved to the leaves after it
+        load(leafIndex);
+        while (key > leaf.highKey() && leaf.nextLeafIndex() != DEFAULT_LOCATION) {
+            load(leaf.nextLeafIndex());
         }
-        cout << endl;
+        position = leaf.getKeyPosition(key) - (forward ? 0 : 1);
+
+        consumed = 0;
+        readAhead(readahead);
+        settle();
     }
 
-    void Node::insertObject(DBObject object) {
-        long position = getKeyPosition(object.getKey());
+    void Cursor::load(long leafIndex) {
+        // Writers may change the leaf at any time, so scans running
+        // concurrently read a copy of it. A cursor holds no latches, and two
+        // cursors can move in either direction.
+        leaf = readNode(leafIndex, copy);
+    }
 
-        // insert the new key to keys
-        keys.insert(keys.begin() + position, object.getKey());
+    void Cursor::settle() {
+        while (true) {
+            if (forward) {
+                while (position >= leaf.size() && leaf.nextLeafIndex() != DEFAULT_LOCATION) {
+                    load(leaf.nextLeafIndex());
+                    position = 0;
+                    consume();
+                }
+            } else {
+                while (position < 0 && leaf.previousLeafIndex() != DEFAULT_LOCATION) {
+                    long fromIndex = leaf.getFileIndex();
+                    load(leaf.previousLeafIndex());
+
+                    // The previous leaf may have split since the link was read,
+                    // the new leaves are between it and the one we came from
+                    while (leaf.nextLeafIndex() != fromIndex && leaf.nextLeafIndex() != DEFAULT_LOCATION) {
+                        load(leaf.nextLeafIndex());
+                    }
+                    position = leaf.size() - 1;
+                    consume();
+                }
+            }
 
-        // insert the object pointer to the end
-        objectPointers.insert(objectPointers.begin() + position, object.getFileIndex());
+            // Step over the removed entries, up to the limits
+            if (position < 0 || position >= leaf.size() || !leaf.isRemoved(position)
+                    || (forward ? leaf.key(position) > upperLimit : leaf.key(position) < lowerLimit)) {
+                return;
+            }
+            position += forward ? 1 : -1;
+        }
+    }
 
-        // Commit the new node back into memory
-        commitToDisk();
+    void Cursor::consume() {
+        // Keep about the same number of leaves in flight, submitted in
+        // batches rather than one at a time
+        if (++consumed >= max(1L, readahead / 2)) {
+            readAhead(consumed);
+            consumed = 0;
+        }
     }
 
-    void Node::serialize() {
-        // Return if node is empty
-        if (keys.size() == 0) {
-            return;
+    void Cursor::readAhead(long count) {
+        vector<long> leaves;
+        for (long i = 0; i < count; ++i) {
+            long leafIndex = nextAhead();
+            if (leafIndex == DEFAULT_LOCATION) {
+                break;
+            }
+            leaves.push_back(leafIndex);
         }
 
-        // Prettify
-        cout << endl << endl;
+        if (!leaves.empty()) {
+            treeFile->prefetch(leaves);
+        }
+    }
 
-        queue< pair<long, char> > previousLevel;
-        previousLevel.push(make_pair(fileIndex, 'N'));
+    long Cursor::nextAhead() {
+        if (path.empty()) {
+            return DEFAULT_LOCATION;
+        }
 
-        long currentIndex;
-        Node *iterator;
-        char type;
-        while (!previousLevel.empty()) {
-            queue< pair<long, char> > nextLevel;
+        // Find the lowest level which has a child in the direction of the
+        // scan. Internal nodes may change under a concurrent scan, they are
+        // read again on the way up.
+        long level = path.size() - 1;
+        while (level >= 0) {
+            if (copiesPages()) {
+                path[level].first = readNode(path[level].first.getFileIndex(), copies[level]);
+                path[level].second = min(path[level].second, path[level].first.size());
+            }
+            if (forward ? path[level].second < path[level].first.size() : path[level].second > 0) {
+                break;
+            }
+            --level;
+        }
 
-            while (!previousLevel.empty()) {
-                // Get the front and pop
-                currentIndex = previousLevel.front().first;
-                iterator = new Node(currentIndex);
-                type = previousLevel.front().second;
-                previousLevel.pop();
+        // Stop at either end of the tree, or when the keys of the next child
+        // are beyond the limits
+        if (level < 0
+                || (forward && path[level].first.key(path[level].second) > upperLimit)
+                || (!forward && path[level].first.key(path[level].second - 1) < lowerLimit)) {
+            path.clear();
+            return DEFAULT_LOCATION;
+        }
 
-                // If it a seperator, print and move ahead
-                if (type == '|') {
-                    cout << "|| ";
-                    continue;
-                }
+        // Move over and down to the level above the leaves, taking the
+        // leftmost children going forward and the rightmost going backward
+        path[level].second += forward ? 1 : -1;
+        for (long i = level + 1; i < (long) path.size(); ++i) {
+            NodeView &parent = path[i - 1].first;
+            NodeView child = readNode(parent.childIndex(path[i - 1].second), copies[i]);
+            path[i] = make_pair(child, forward ? 0 : child.size());
+        }
 
-                // Print all the keys
-                for (auto key : iterator->keys) {
-                    cout << key << " ";
-                }
+        return path.back().first.childIndex(path.back().second);
+    }
 
-                // Enqueue all the children
-                for (auto childIndex : iterator->childIndices) {
-                    nextLevel.push(make_pair(childIndex, 'N'));
+    // What a query hands over for each entry it finds. Strings in the
+    // object store are only read for records.
+    enum ResultFields {
+        RESULT_RECORDS = 0,                     // The dataString
+        RESULT_KEYS = 1,                        // The key
+        RESULT_POINTERS = 2                     // The object pointer
+    };
 
-                    // Insert a marker to indicate end of child
-                    nextLevel.push(make_pair(DEFAULT_LOCATION, '|'));
-                }
+    // Takes the entries a query finds, in the order the query finds them.
+    // The entries are objects whose dataString is read once it is asked for.
+    // The base sink drops them, for queries which are only timed.
+    class ResultSink {
+        public:
+            ResultFields fields;
 
-                // Delete allocated memory
-                delete iterator;
-            }
+            ResultSink(ResultFields _fields = RESULT_RECORDS) : fields(_fields) {}
+            virtual ~ResultSink() {}
 
-            // Seperate different levels
-            cout << endl << endl;
-            previousLevel = nextLevel;
+            // Take the next entry
+            virtual void add(DBObject &object) {}
+    };
+
+    // Hands every entry to a function
+    class CallbackSink : public ResultSink {
+        private:
+            function<void(DBObject &)> callback;
+
+        public:
+            CallbackSink(function<void(DBObject &)> _callback, ResultFields _fields = RESULT_RECORDS)
+                : ResultSink(_fields), callback(_callback) {}
+
+            void add(DBObject &object) { callback(object); }
+    };
+
+    // Collects the entries into a vector, reading their strings if the
+    // records are asked for
+    class VectorSink : public ResultSink {
+        private:
+            vector<DBObject> &results;
+
+        public:
+            VectorSink(vector<DBObject> &_results, ResultFields _fields = RESULT_RECORDS)
+                : ResultSink(_fields), results(_results) {}
+
+            void add(DBObject &object);
+    };
+
+    void VectorSink::add(DBObject &object) {
+        if (fields == RESULT_RECORDS) {
+            object.getDataString();
         }
+        results.push_back(object);
     }
 
-    void Node::insertNode(double key, long leftChildIndex, long rightChildIndex) {
-        // insert the new key to keys
-        long position = getKeyPosition(key);
-        keys.insert(keys.begin() + position, key);
+    // Writes a line per entry to a stream, through a buffer which is
+    // written out once it is bufferSize bytes and when the sink is flushed
+    // or done
+    class StreamSink : public ResultSink {
+        private:
+            ostream &out;
+            string buffer;
+            long bufferSize;
+            ostringstream formatter;            // Formats keys as out would
 
-        // insert the newChild
-        childIndices.insert(childIndices.begin() + position + 1, rightChildIndex);
+        public:
+            StreamSink(ostream &_out, ResultFields _fields = RESULT_RECORDS,
+                    long _bufferSize = DEFAULT_OUTPUT_BUFFER_SIZE)
+                : ResultSink(_fields), out(_out), bufferSize(_bufferSize) {
+                formatter.copyfmt(out);
+            }
+            ~StreamSink() { flush(); }
 
-        // commit changes to disk
-        commitToDisk();
+            void add(DBObject &object);
 
-#ifdef DEBUG_VERBOSE
-        cout << endl;
-        cout << "InsertNode : " << endl;
-        cout << "Base Node : ";
-        for (auto key : keys) {
-            cout << key << " ";
+            // Write out the buffered lines
+            void flush();
+    };
+
+    void StreamSink::add(DBObject &object) {
+#ifdef DEBUG_NORMAL
+        formatter.str("");
+        formatter << object.getKey() << " ";
+        buffer.append(formatter.str());
+#endif
+        if (fields == RESULT_RECORDS) {
+            buffer.append(object.getDataString());
+        } else {
+            formatter.str("");
+            if (fields == RESULT_KEYS) {
+                formatter << object.getKey();
+            } else {
+                formatter << object.getFileIndex();
+            }
+            buffer.append(formatter.str());
         }
-        cout << endl;
+        buffer.push_back('\n');
 
-        // Print them out
-        Node *leftChild = new Node(leftChildIndex);
-        cout << "LeftNode : ";
-        for (auto key : leftChild->keys) {
-            cout << key << " ";
+        if ((long) buffer.size() >= bufferSize) {
+            flush();
         }
-        cout << endl;
-        delete leftChild;
+    }
 
-        Node *rightChild = new Node(rightChildIndex);
-        cout << "RightNode : ";
-        for (auto key : rightChild->keys) {
-            cout << key << " ";
+    void StreamSink::flush() {
+        if (!buffer.empty()) {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
         }
-        cout << endl;
-        delete rightChild;
-#endif
+    }
 
-        // If this overflows, we move again upward
-        if ((long)keys.size() > upperBound) {
-            splitInternal();
+    // Point search in a BPlusTree
+    void pointQuery(const Key &searchKey, ResultSink &sink) {
+        // Walk over all the entries with the key
+        Cursor cursor(searchKey, searchKey);
+        for (cursor.seek(searchKey); cursor.valid(); cursor.next()) {
+            DBObject object = cursor.object();
+            sink.add(object);
         }
+    }
 
-        // Update the root if the element was inserted in the root
-        if (fileIndex == bRoot->getFileIndex()) {
-            bRoot->readFromDisk();
+    // window search
+    void windowQuery(const Key &lowerLimit, const Key &upperLimit, ResultSink &sink) {
+        // Walk over all the entries in the window
+        Cursor cursor(lowerLimit, upperLimit);
+        for (cursor.seek(lowerLimit); cursor.valid(); cursor.next()) {
+            DBObject object = cursor.object();
+            sink.add(object);
         }
     }
 
-    void Node::splitInternal() {
-#ifdef DEBUG_VERBOSE
-        cout << endl;
-        cout << "SplitInternal : " << endl;
-        cout << "Base Node : ";
-        for (auto key : keys) {
-            cout << key << " ";
+#ifndef STRING_KEYS
+    // Range and kNN queries measure distances between keys, so they need
+    // numeric keys
+
+    //rangesearch
+    void rangeQuery(Key center, double range, ResultSink &sink) {
+        Key upperBound = KeyFormat<Key>::below(center + range);
+        Key lowerBound = (center - range >= 0) ? KeyFormat<Key>::above(center - range) : 0;
+
+        // Call windowQuery internally
+        windowQuery(lowerBound, upperBound, sink);
+    }
+
+    // Merge the entries of cursors on either side of center by distance,
+    // handing the closest k to the sink
+    void mergeNearest(Cursor &ahead, Cursor &behind, Key center, long k, ResultSink &sink) {
+        for (long count = 0; count < k && (ahead.valid() || behind.valid()); ++count) {
+            // Take the closer of the two heads
+            bool takeAhead = !behind.valid()
+                || (ahead.valid() && ahead.key() - center <= center - behind.key());
+            Cursor &closest = takeAhead ? ahead : behind;
+
+            DBObject object = closest.object();
+            sink.add(object);
+            closest.next();
         }
-        cout << endl;
+    }
+
+    // Leaves a kNN query reads ahead on either side
+    long kNNReadahead(long k) {
+        return min((long) getOption("readahead", DEFAULT_READAHEAD), k / Node::lowerBound + 1);
+    }
+
+    // kNN query
+    void kNNQuery(Key center, long k, ResultSink &sink) {
+        // Expand outwards from the center with a cursor on either side, the
+        // leaves needed for k entries are read ahead
+        Cursor ahead(KeyFormat<Key>::lowest(), KeyFormat<Key>::infinity(), true, kNNReadahead(k));
+        Cursor behind(KeyFormat<Key>::lowest(), KeyFormat<Key>::infinity(), false, kNNReadahead(k));
+
+        // Both start from the same leaf
+        vector< pair<NodeView, long> > path;
+        long leafIndex = findLeaf(center, path);
+        ahead.start(path, leafIndex, center);
+        behind.start(path, leafIndex, center);
+
+        mergeNearest(ahead, behind, center, k, sink);
+    }
+
 #endif
 
-        // Create a surrogate internal node
-        Node *surrogateInternalNode = new Node();
-        surrogateInternalNode->setToInternalNode();
+    // A query read from the query file. Point, range and window queries
+    // visit the keys from lowerLimit to upperLimit, kNN queries start at
+    // lowerLimit which is their center. Inserts add key and dataString,
+    // removes take out the entries with key.
+    struct Query {
+        long type;                          // 0 to QUERY_TYPES - 1
+        Key key;
+        double range;
+        long k;
+        Key lowerLimit;
+        Key upperLimit;
+        string dataString;
+
+        // Where the lowerLimit is found in the tree, when answered in a batch
+        vector< pair<NodeView, long> > path;
+        long leafIndex;
+    };
 
-        // Fix the keys of the new node
-        double startPoint = *(keys.begin() + lowerBound);
-        for (auto key = keys.begin() + lowerBound + 1; key != keys.end(); ++key) {
-            surrogateInternalNode->keys.push_back(*key);
-        }
+    // Latencies in nanoseconds counted in log-linear buckets. Values below
+    // 2^HISTOGRAM_PRECISION have a bucket each, every larger power of two
+    // is split into 2^(HISTOGRAM_PRECISION - 1) buckets of equal width.
+    class LatencyHistogram {
+        private:
+            vector<long> counts;
+            long count;
+            long minimum;
+            long maximum;
+            double sum;
+            double sumOfSquares;
+            mutex access;
+
+            // Bucket of a value, and the largest value in a bucket
+            static long bucket(long value);
+            static long bucketLimit(long index);
 
-        // Resize the keys of the current node
-        keys.resize(lowerBound);
+        public:
+            LatencyHistogram();
 
-#ifdef DEBUG_VERBOSE
-        // Print them out
-        cout << "First InternalNode : ";
-        for (auto key : keys) {
-            cout << key << " ";
+            // Count a latency
+            void record(long nanoseconds);
+
+            // Return the number of latencies counted
+            long size() { return count; }
+
+            // Return the latency which fraction of the latencies do not
+            // exceed, to within the width of its bucket
+            long percentile(double fraction);
+
+            long min() { return count == 0 ? 0 : minimum; }
+            long max() { return maximum; }
+            double mean() { return count == 0 ? 0 : sum / count; }
+            double deviation() { return count == 0 ? 0 : sqrt(std::max(0.0, sumOfSquares / count - mean() * mean())); }
+    };
+
+    LatencyHistogram::LatencyHistogram() : count(0), minimum(0), maximum(0), sum(0), sumOfSquares(0) {
+        counts.resize(bucket(numeric_limits<long>::max()) + 1);
+    }
+
+    long LatencyHistogram::bucket(long value) {
+        long linear = 1L << HISTOGRAM_PRECISION;
+        long half = linear / 2;
+        if (value < linear) {
+            return value < 0 ? 0 : value;
         }
-        cout << endl;
 
-        cout << "Second InternalNode : ";
-        for (auto key : surrogateInternalNode->keys) {
-            cout << key << " ";
+        // The leading bits of the value pick the bucket within its power
+        long magnitude = 63 - __builtin_clzl(value);
+        long shift = magnitude - (HISTOGRAM_PRECISION - 1);
+        return linear + (magnitude - HISTOGRAM_PRECISION) * half + ((value >> shift) - half);
+    }
+
+    long LatencyHistogram::bucketLimit(long index) {
+        long linear = 1L << HISTOGRAM_PRECISION;
+        long half = linear / 2;
+        if (index < linear) {
+            return index;
         }
-        cout << endl;
 
-        cout << "Split At " << startPoint << endl;
-#endif
+        long magnitude = (index - linear) / half + HISTOGRAM_PRECISION;
+        long shift = magnitude - (HISTOGRAM_PRECISION - 1);
+        long leading = (index - linear) % half + half;
+        return ((leading + 1) << shift) - 1;
+    }
 
-        // Partition children for the surrogateInternalNode
-        for (auto childIndex = childIndices.begin() + lowerBound + 1; childIndex != childIndices.end(); ++childIndex) {
-            surrogateInternalNode->childIndices.push_back(*childIndex);
+    void LatencyHistogram::record(long nanoseconds) {
+        lock_guard<mutex> guard(access);
+        counts[bucket(nanoseconds)]++;
+        minimum = (count == 0) ? nanoseconds : std::min(minimum, nanoseconds);
+        maximum = std::max(maximum, nanoseconds);
+        sum += nanoseconds;
+        sumOfSquares += (double) nanoseconds * nanoseconds;
+        count++;
+    }
 
-            // Assign parent to the children nodes
-            Node *tempChildNode = new Node(*childIndex);
-            tempChildNode->parentIndex = surrogateInternalNode->fileIndex;
-            tempChildNode->commitToDisk();
-            delete tempChildNode;
+    long LatencyHistogram::percentile(double fraction) {
+        if (count == 0) {
+            return 0;
         }
 
-        // Fix children for the current node
-        childIndices.resize(lowerBound + 1);
+        // Walk the buckets till rank latencies are passed
+        long rank = std::max(1L, (long) ceil(fraction * count));
+        long seen = 0;
+        for (long i = 0; i < (long) counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(bucketLimit(i), maximum);
+            }
+        }
 
-        // If the current node is not a root node
-        if (parentIndex != DEFAULT_LOCATION) {
-            // Assign parents
-            surrogateInternalNode->parentIndex = parentIndex;
-            surrogateInternalNode->commitToDisk();
-            commitToDisk();
+        return maximum;
+    }
 
-            // Now we push up the splitting one level
-            Node *tempParent = new Node(parentIndex);
-            tempParent->insertNode(startPoint, fileIndex, surrogateInternalNode->fileIndex);
-            delete tempParent;
-        } else {
-            // Create a new parent node
-            Node *newParent = new Node();
-            newParent->setToInternalNode();
+    // Latencies of the queries of each type, in timing mode
+    LatencyHistogram latencies[QUERY_TYPES];
+
+    // Descend once for every group of queries which go through the same
+    // child. order holds the queries sorted by lowerLimit. As in findLeaf,
+    // the groups are validated before they are followed, and the queries
+    // past the highKey of a node which split go to its right link.
+    void descendBatch(long fileIndex, vector<Query> &queries, vector<long> &order,
+            long begin, long end, vector< pair<NodeView, long> > &path) {
+        struct Group {
+            long end;
+            long position;
+            long childIndex;
+        };
 
-            // Assign parents
-            surrogateInternalNode->parentIndex = newParent->fileIndex;
-            parentIndex = newParent->fileIndex;
+        NodeView node;
+        vector<Group> groups;
+        long split;
+        long rightIndex;
+        while (true) {
+            unsigned long version = concurrent ? latchTable->readVersion(fileIndex) : 0;
+            node = viewNode(fileIndex);
+
+            rightIndex = node.rightLinkIndex();
+            split = end;
+            while (rightIndex != DEFAULT_LOCATION && split > begin && queries[order[split - 1]].lowerLimit > node.highKey()) {
+                --split;
+            }
 
-            // Insert the key into the keys
-            newParent->keys.push_back(startPoint);
+            // Find the queries which go into the same child
+            groups.clear();
+            for (long groupBegin = begin; !node.isLeaf() && groupBegin < split; groupBegin = groups.back().end) {
+                long position = node.getKeyPosition(queries[order[groupBegin]].lowerLimit);
+                long groupEnd = groupBegin + 1;
+                while (groupEnd < split && node.getKeyPosition(queries[order[groupEnd]].lowerLimit) == position) {
+                    ++groupEnd;
+                }
+                groups.push_back({groupEnd, position, node.childIndex(position)});
+            }
 
-            // Insert the children
-            newParent->childIndices.push_back(fileIndex);
-            newParent->childIndices.push_back(surrogateInternalNode->fileIndex);
+            if (!concurrent || latchTable->validate(fileIndex, version)) {
+                break;
+            }
+        }
 
-            // Commit changes to disk
-            newParent->commitToDisk();
-            commitToDisk();
-            surrogateInternalNode->commitToDisk();
+        if (node.isLeaf()) {
+            for (long i = begin; i < split; ++i) {
+                Query &query = queries[order[i]];
+                query.path = path;
+                query.leafIndex = fileIndex;
+            }
+        }
 
-            // Clean up the previous root node
-            delete bRoot;
+        // The children of all the groups are read together
+        if (groups.size() > 1) {
+            vector<long> children;
+            for (auto &group : groups) {
+                children.push_back(group.childIndex);
+            }
+            treeFile->prefetch(children);
+        }
 
-            // Reset the root node
-            bRoot = newParent;
+        for (auto &group : groups) {
+            path.push_back(make_pair(node, group.position));
+            descendBatch(group.childIndex, queries, order, begin, group.end, path);
+            path.pop_back();
+            begin = group.end;
         }
 
-        // Clean the surrogateInternalNode
-        delete surrogateInternalNode;
+        if (split < end) {
+            descendBatch(rightIndex, queries, order, split, end, path);
+        }
     }
 
-    void Node::splitLeaf() {
-#ifdef DEBUG_VERBOSE
-        cout << endl;
-        cout << "SplitLeaf : " << endl;
-        cout << "Base Node : ";
+    // Answer a query, handing the entries it finds to the sink
+    void executeQuery(Query &query, ResultSink &sink) {
+        if (query.type == 0) {
+            insert(DBObject(query.key, query.dataString));
+        } else if (query.type == 1) {
+            pointQuery(query.key, sink);
+#ifndef STRING_KEYS
+        } else if (query.type == 2) {
+            rangeQuery(query.key, query.range * 0.1, sink);
+        } else if (query.type == 3) {
+            kNNQuery(query.key, query.k, sink);
+#endif
+        } else if (query.type == 4) {
+            windowQuery(query.lowerLimit, query.upperLimit, sink);
+        } else if (query.type == 5) {
+            remove(query.key);
+        }
+    }
 
-        for (auto key : keys) {
-            cout << key << " ";
+    // Answer point, range, window and kNN queries together, handing the
+    // entries of each query to its sink in sinks. The tree is descended once
+    // for all of them, then the point, range and window queries share a
+    // single sweep along the leaves.
+    void executeBatch(vector<Query> &queries, vector<ResultSink *> &sinks) {
+        // Find the last key the sweep needs
+        vector<long> order;
+        vector<long> sweep;
+        Key sweepLimit = KeyFormat<Key>::lowest();
+        for (long i = 0; i < (long) queries.size(); ++i) {
+            order.push_back(i);
+            if (queries[i].type != 3) {
+                sweepLimit = max(sweepLimit, queries[i].upperLimit);
+            }
         }
-        cout << endl;
+
+        auto byLowerLimit = [&](long first, long second) {
+            return queries[first].lowerLimit < queries[second].lowerLimit;
+        };
+        stable_sort(order.begin(), order.end(), byLowerLimit);
+
+        vector< pair<NodeView, long> > path;
+        descendBatch(currentRoot(), queries, order, 0, order.size(), path);
+
+        for (auto i : order) {
+#ifndef STRING_KEYS
+            if (queries[i].type == 3) {
+                // kNN queries expand from where the descent left them
+                Query &query = queries[i];
+                Cursor ahead(KeyFormat<Key>::lowest(), KeyFormat<Key>::infinity(), true, kNNReadahead(query.k));
+                Cursor behind(KeyFormat<Key>::lowest(), KeyFormat<Key>::infinity(), false, kNNReadahead(query.k));
+                ahead.start(query.path, query.leafIndex, query.lowerLimit);
+                behind.start(query.path, query.leafIndex, query.lowerLimit);
+                mergeNearest(ahead, behind, query.lowerLimit, query.k, *sinks[i]);
+                continue;
+            }
 #endif
-
-        // Create a surrogate leaf node with the keys and object Pointers
-        Node *surrogateLeafNode = new Node();
-        for (long i = lowerBound; i < (long) keys.size(); ++i) {
-            DBObject object = DBObject(keys[i], objectPointers[i]);
-            surrogateLeafNode->insertObject(object);
+            sweep.push_back(i);
         }
 
-        // Resize the current leaf node and commit the node to disk
-        keys.resize(lowerBound);
-        objectPointers.resize(lowerBound);
+        // Sweep the leaves, queries become active at their first entry and
+        // are done once the keys pass their upperLimit. When no query is
+        // active, the sweep jumps to where the next one starts.
+        Cursor cursor(KeyFormat<Key>::lowest(), sweepLimit);
+        vector<long> active;
+        long next = 0;
+        while (next < (long) sweep.size() || !active.empty()) {
+            if (active.empty()) {
+                Query &query = queries[sweep[next]];
+                cursor.start(query.path, query.leafIndex, query.lowerLimit);
+            }
 
-#ifdef DEBUG_VERBOSE
-        // Print them out
-        cout << "First Leaf : ";
-        for (auto key : keys) {
-            cout << key << " ";
-        }
-        cout << endl;
+            // Nothing is left in the tree
+            if (!cursor.valid()) {
+                break;
+            }
 
-        cout << "Second Leaf : ";
-        for (auto key : surrogateLeafNode->keys) {
-            cout << key << " ";
+            Key key = cursor.key();
+            while (next < (long) sweep.size() && queries[sweep[next]].lowerLimit <= key) {
+                active.push_back(sweep[next++]);
+            }
+
+            // Hand over the entry to the active queries
+            long remaining = 0;
+            for (auto i : active) {
+                if (key <= queries[i].upperLimit) {
+                    DBObject object = cursor.object();
+                    sinks[i]->add(object);
+                    active[remaining++] = i;
+                }
+            }
+            active.resize(remaining);
+
+            cursor.next();
         }
-        cout << endl;
-#endif
+    }
 
-        // Link up the leaves
-        long tempLeafIndex = nextLeafIndex;
-        nextLeafIndex = surrogateLeafNode->fileIndex;
-        surrogateLeafNode->nextLeafIndex = tempLeafIndex;
+    // Records read for bulk loading, the sequence keeps the sort stable
+    struct BulkRecord {
+        Key key;
+        long sequence;
+        string dataString;
 
-        // If the tempLeafIndex is not null we have to load it and set its
-        // previous index
-        if (tempLeafIndex != DEFAULT_LOCATION) {
-            Node *tempLeaf = new Node(tempLeafIndex);
-            tempLeaf->previousLeafIndex = surrogateLeafNode->fileIndex;
-            tempLeaf->commitToDisk();
-            delete tempLeaf;
+        bool operator<(const BulkRecord &other) const {
+            return key < other.key || (key == other.key && sequence < other.sequence);
         }
+    };
 
-        surrogateLeafNode->previousLeafIndex = fileIndex;
+    // Sort records which need not fit in memory. Runs of runSize records are
+    // sorted on worker threads and spilled to disk, then merged.
+    class ExternalSorter {
+        private:
+            long runSize;
+            long threads;
+            long recordCount;
+            vector<BulkRecord> memoryRun;       // Used if everything fits
+            vector<string> runFiles;
+            vector<thread> workers;
 
-        // Consider the case when the current node is not a root
-        if (parentIndex != DEFAULT_LOCATION) {
-            // Assign parents
-            surrogateLeafNode->parentIndex = parentIndex;
-            surrogateLeafNode->commitToDisk();
-            commitToDisk();
+            // Sort a run and write it out to a file
+            static void writeRun(vector<BulkRecord> run, string fileName);
 
-            // Now we push up the splitting one level
-            Node *tempParent = new Node(parentIndex);
-            tempParent->insertNode(surrogateLeafNode->keys.front(), fileIndex, surrogateLeafNode->fileIndex);
-            delete tempParent;
-        } else {
-            // Create a new parent node
-            Node *newParent = new Node();
-            newParent->setToInternalNode();
+            // Read the next record of a run, return false at the end
+            static bool readRecord(ifstream &runFile, BulkRecord &record);
 
-            // Assign parents
-            surrogateLeafNode->parentIndex = newParent->fileIndex;
-            parentIndex = newParent->fileIndex;
+        public:
+            ExternalSorter(long _runSize, long _threads)
+                : runSize(_runSize), threads(_threads), recordCount(0) {}
+            ~ExternalSorter();
 
-            // Insert the key into the keys
-            newParent->keys.push_back(surrogateLeafNode->keys.front());
+            // Read all the key, dataString pairs from the input
+            void sort(istream &input);
 
-            // Insert the children
-            newParent->childIndices.push_back(this->fileIndex);
-            newParent->childIndices.push_back(surrogateLeafNode->fileIndex);
+            // Number of records read
+            long size() { return recordCount; }
 
-            // Commit to disk
-            newParent->commitToDisk();
-            surrogateLeafNode->commitToDisk();
-            commitToDisk();
+            // Hand over the records in sorted order
+            void merge(function<void(BulkRecord &)> consumer);
+    };
+
+    ExternalSorter::~ExternalSorter() {
+        for (auto &runFile : runFiles) {
+            ::remove(runFile.c_str());
+        }
+    }
 
-            // Clean up the root node
-            delete bRoot;
+    void ExternalSorter::writeRun(vector<BulkRecord> run, string fileName) {
+        std::sort(run.begin(), run.end());
+
+        ofstream runFile(fileName, ios::binary|ios::out);
+        string key;
+        for (auto &record : run) {
+            key.clear();
+            KeyFormat<Key>::encode(record.key, key);
+            long keyLength = key.size();
+            long length = record.dataString.size();
+            runFile.write((char *) &keyLength, sizeof(keyLength));
+            runFile.write(key.data(), keyLength);
+            runFile.write((char *) &record.sequence, sizeof(record.sequence));
+            runFile.write((char *) &length, sizeof(length));
+            runFile.write(record.dataString.data(), length);
+        }
+        runFile.close();
+    }
+
+    bool ExternalSorter::readRecord(ifstream &runFile, BulkRecord &record) {
+        long keyLength;
+        long length;
+        runFile.read((char *) &keyLength, sizeof(keyLength));
+        if (!runFile) {
+            return false;
+        }
 
-            // Reset the root node
-            bRoot = newParent;
+        string key(keyLength, '\0');
+        runFile.read(&key[0], keyLength);
+        KeyFormat<Key>::decode(key.data(), record.key);
+        runFile.read((char *) &record.sequence, sizeof(record.sequence));
+        runFile.read((char *) &length, sizeof(length));
+        if (!runFile) {
+            return false;
         }
 
-        // Clean up surrogateNode
-        delete surrogateLeafNode;
+        record.dataString.resize(length);
+        runFile.read(&record.dataString[0], length);
+        return true;
     }
 
-    // Insert a key into the BPlusTree
-    void insert(Node *root, DBObject object) {
-        // If the root is a leaf, we can directly insert
-        if (root->isLeaf()) {
-            // Insert object
-            root->insertObject(object);
+    void ExternalSorter::sort(istream &input) {
+        BulkRecord record;
+        vector<BulkRecord> run;
+        while (input >> record.key >> record.dataString) {
+            // Keys which do not fit in a node are left out
+            if (!KeyFormat<Key>::validate(record.key)) {
+                continue;
+            }
+            record.sequence = recordCount++;
+            run.push_back(record);
 
-            // Split if required
-            if (root->size() > root->upperBound) {
-                root->splitLeaf();
+            if ((long) run.size() < runSize) {
+                continue;
             }
 
-#ifdef DEBUG_VERBOSE
-            // Serialize
-            bRoot->serialize();
-#endif
-        } else {
-            // We traverse the tree
-            long position = root->getKeyPosition(object.getKey());
+            // Wait for the oldest worker if all of them are busy
+            if ((long) workers.size() >= threads) {
+                workers.front().join();
+                workers.erase(workers.begin());
+            }
 
-            // Load the node from disk
-            Node *nextRoot = new Node(root->childIndices[position]);
+            runFiles.push_back(SORT_RUN_PREFIX + to_string(runFiles.size()));
+            workers.push_back(thread(writeRun, std::move(run), runFiles.back()));
+            run = vector<BulkRecord>();
+        }
 
-            // Recurse into the node
-            insert(nextRoot, object);
+        // If nothing was spilled, the input fits in memory
+        if (runFiles.empty()) {
+            std::sort(run.begin(), run.end());
+            memoryRun = std::move(run);
+        } else if (!run.empty()) {
+            runFiles.push_back(SORT_RUN_PREFIX + to_string(runFiles.size()));
+            workers.push_back(thread(writeRun, std::move(run), runFiles.back()));
+        }
 
-            // Clean up
-            delete nextRoot;
+        for (auto &worker : workers) {
+            worker.join();
         }
+        workers.clear();
     }
 
-    // Point search in a BPlusTree
-    void pointQuery(Node *root, double searchKey) {
-        // If the root is a leaf, we can directly search
-        if (root->isLeaf()) {
-            // Print all nodes in the current leaf
-            for (long i = 0; i < (long) root->keys.size(); ++i) {
-                if (root->keys[i] == searchKey) {
-#ifdef DEBUG_NORMAL
-                    cout << root->keys[i] << " ";
-#endif
-#ifdef OUTPUT
-                    cout << DBObject(root->keys[i], root->objectPointers[i]).getDataString() << endl;
-#endif
-                }
+    void ExternalSorter::merge(function<void(BulkRecord &)> consumer) {
+        if (runFiles.empty()) {
+            for (auto &record : memoryRun) {
+                consumer(record);
             }
+            memoryRun.clear();
+            return;
+        }
 
-            // Check nextleaf for same node
-            if (root->nextLeafIndex != DEFAULT_LOCATION) {
-                // Load up the nextLeaf from disk
-                Node *tempNode = new Node(root->nextLeafIndex);
-
-                // Check in the nextLeaf and delegate
-                if (tempNode->keys.front() == searchKey) {
-                    pointQuery(tempNode, searchKey);
-                }
+        // Open all the runs and load their first records
+        vector<ifstream> runs(runFiles.size());
+        vector<BulkRecord> heads(runFiles.size());
+        auto later = [&](long first, long second) { return heads[second] < heads[first]; };
+        priority_queue<long, vector<long>, decltype(later)> candidates(later);
 
-                delete tempNode;
+        for (long i = 0; i < (long) runFiles.size(); ++i) {
+            runs[i].open(runFiles[i], ios::binary|ios::in);
+            if (readRecord(runs[i], heads[i])) {
+                candidates.push(i);
             }
-        } else {
-            // We traverse the tree
-            long position = root->getKeyPosition(searchKey);
+        }
 
-            // Load the node from disk
-            Node *nextRoot = new Node(root->childIndices[position]);
+        // Repeatedly hand over the smallest head
+        while (!candidates.empty()) {
+            long run = candidates.top();
+            candidates.pop();
 
-            // Recurse into the node
-            pointQuery(nextRoot, searchKey);
+            consumer(heads[run]);
 
-            // Clean up
-            delete nextRoot;
+            if (readRecord(runs[run], heads[run])) {
+                candidates.push(run);
+            }
         }
     }
 
-    // window search
-    void windowQuery(Node *root, double lowerLimit, double upperLimit) {
-        // If the root is a leaf, we can directly search
-        if (root->isLeaf()) {
-            // Print all nodes in the current leaf which satisfy the criteria
-            for (long i = 0; i < (long) root->keys.size(); ++i) {
-                if (root->keys[i] >= lowerLimit && root->keys[i] <= upperLimit) {
-#ifdef DEBUG_NORMAL
-                    cout << root->keys[i] << " ";
-#endif
-#ifdef OUTPUT
-                    cout << DBObject(root->keys[i], root->objectPointers[i]).getDataString() << endl;
-#endif
-                }
-            }
+    // Build the tree bottom up from records in sorted order. Every node is
+    // filled to fillFactor of its capacity before the next one on its level
+    // is started. Once all the records are in, the last node of each level
+    // is evened out with the one before it.
+    class BulkLoader {
+        private:
+            long fill;                          // Space filled in each node
+            long leafFill;                      // Same for the leaves
+            vector<Node *> openNodes;           // Node being filled on each level
+            vector<Key> firstKeys;              // Separator before each open node
+            vector<long> lastNodes;             // Last finished node on each level
+            Node *lastLeaf;
 
-            // If the nextLeafNode is not null
-            if (root->nextLeafIndex != DEFAULT_LOCATION) {
-                Node *tempNode= new Node(root->nextLeafIndex);
+            // Check if the open node of a level has room for key
+            bool fits(long level, const Key &key);
 
-                // Check for condition and recurse
-                if (tempNode->keys.front() >= lowerLimit && tempNode->keys.front() <=upperLimit) {
-                    windowQuery(tempNode, lowerLimit, upperLimit);
-                }
+            // Create the next node on a level
+            void openNode(long level);
 
-                // Delete the tempNode
-                delete tempNode;
-            }
-        } else {
-            // We traverse the tree
-            long position = root->getKeyPosition(lowerLimit);
+            // Hand over a full node to its parent
+            void finishNode(long level);
+
+            // Link the last finished node of a level to the open one
+            void linkNode(long level);
 
-            // Load the node from disk
-            Node *nextRoot = new Node(root->childIndices[position]);
+        public:
+            BulkLoader(double fillFactor);
 
-            // Recurse into the node
-            windowQuery(nextRoot, lowerLimit, upperLimit);
+            // Add the next record in sorted order
+            void add(DBObject &object);
 
-            // Clean up
-            delete nextRoot;
-        }
+            // Finish the open nodes once all the records are added
+            void finish();
+    };
+
+    BulkLoader::BulkLoader(double fillFactor) : lastLeaf(nullptr) {
+        // Keep nodes at least half full, with room for the highKey they get
+        // once the node after them is started
+        fillFactor = max(0.5, min(1.0, fillFactor));
+        fill = min((long) (Node::capacity * fillFactor), Node::capacity - KeyFormat<Key>::highKeySpace());
+        leafFill = min((long) (Node::leafCapacity * fillFactor), Node::leafCapacity - KeyFormat<Key>::highKeySpace());
+
+        openNodes.assign(1, nullptr);
+        firstKeys.assign(1, Key());
+        lastNodes.assign(1, DEFAULT_LOCATION);
     }
 
-    //rangesearch
-    void rangeQuery(Node *root, double center, double range) {
-        double upperBound = center + range;
-        double lowerBound = (center - range >= 0) ? center - range : 0;
+    bool BulkLoader::fits(long level, const Key &key) {
+        // Internal nodes take a child along with the key
+        Node *node = openNodes[level];
+        node->keys.push_back(key);
+        bool fits = node->space() <= (level == 0 ? leafFill : fill);
+        node->keys.pop_back();
 
-        // Call windowQuery internally
-        windowQuery(root, lowerBound, upperBound);
+        return fits;
     }
 
-    // kNN query
-    void kNNQuery(Node *root, double center, long k) {
-        // If the root is a leaf, we can directly search
-        if (root->isLeaf()) {
-            vector< pair<double, long> > answers;
+    void BulkLoader::openNode(long level) {
+        if (level == 0 && lastLeaf == nullptr) {
+            // The empty root is reused as the first leaf
+            openNodes[level] = bRoot;
+            return;
+        }
 
-            // We traverse the tree
-            long position = root->getKeyPosition(center);
+        Node *node = bufferPool->create();
+        if (level == 0) {
+            // Link up the leaves
+            lastLeaf->nextLeafIndex = node->getFileIndex();
+            node->previousLeafIndex = lastLeaf->getFileIndex();
+            lastLeaf->commitToDisk();
+        } else {
+            node->setToInternalNode();
+        }
 
-            // Get k keys from ahead
-            long count = 0;
-            for (long i = position; i < (long)root->keys.size(); ++i, ++count) {
-                answers.push_back(make_pair(root->keys[i], root->objectPointers[i]));
-            }
+        openNodes[level] = node;
+    }
 
-            // Now check for leaves in front
-            long nextIndex = root->nextLeafIndex;
-            while (count < k && nextIndex != DEFAULT_LOCATION) {
-                Node tempNode = Node(nextIndex);
+    void BulkLoader::finishNode(long level) {
+        Node *node = openNodes[level];
+        openNodes[level] = nullptr;
+        lastNodes[level] = node->getFileIndex();
 
-                for (long i = 0; i < (long) tempNode.keys.size(); ++i, ++ count) {
-                    answers.push_back(make_pair(tempNode.keys[i], tempNode.objectPointers[i]));
-                }
+        // The first node finished on the top level needs a parent
+        if (level == (long) openNodes.size() - 1) {
+            openNodes.push_back(nullptr);
+            firstKeys.push_back(Key());
+            lastNodes.push_back(DEFAULT_LOCATION);
+        }
 
-                // Update the nextIndex
-                nextIndex = tempNode.nextLeafIndex;
-            }
+        // Add the node as the next child of its parent, which is finished
+        // first if it is full
+        if (openNodes[level + 1] != nullptr && !fits(level + 1, firstKeys[level])) {
+            finishNode(level + 1);
+        }
+        if (openNodes[level + 1] == nullptr) {
+            openNode(level + 1);
+            firstKeys[level + 1] = firstKeys[level];
+            linkNode(level + 1);
+        } else {
+            openNodes[level + 1]->keys.push_back(firstKeys[level]);
+        }
 
-            // Get k keys from behind
-            count = 0;
-            for (long i = 0; i < (long) position; ++i, ++count) {
-                answers.push_back(make_pair(root->keys[i], root->objectPointers[i]));
+        Node *parent = openNodes[level + 1];
+        parent->childIndices.push_back(node->getFileIndex());
+        node->commitToDisk();
+
+        // Leaves are kept pinned till the next leaf is linked to them
+        if (level == 0) {
+            if (lastLeaf != nullptr && lastLeaf != bRoot) {
+                bufferPool->release(lastLeaf);
             }
+            lastLeaf = node;
+        } else {
+            bufferPool->release(node);
+        }
+    }
 
-            // Check for leaves behind
-            long previousIndex = root->previousLeafIndex;
-            while (count < k && previousIndex != DEFAULT_LOCATION) {
-                Node tempNode = Node(previousIndex);
+    void BulkLoader::linkNode(long level) {
+        if (lastNodes[level] == DEFAULT_LOCATION) {
+            return;
+        }
 
-                for (long i = 0; i < (long) tempNode.keys.size(); ++i, ++ count) {
-                    answers.push_back(make_pair(tempNode.keys[i], tempNode.objectPointers[i]));
-                }
+        // The open node starts where the last one ends, leaves are already
+        // linked through nextLeafIndex
+        Node *node = bufferPool->fetch(lastNodes[level]);
+        node->highKey = firstKeys[level];
+        if (level > 0) {
+            node->rightLinkIndex = openNodes[level]->getFileIndex();
+        }
+        node->commitToDisk();
+        bufferPool->release(node);
+    }
 
-                // Update the nextIndex
-                previousIndex = tempNode.previousLeafIndex;
-            }
+    void BulkLoader::add(DBObject &object) {
+        Key key = object.getKey();
+        if (openNodes[0] != nullptr && !fits(0, key)) {
+            finishNode(0);
+        }
 
-            // Sort the obtained answers
-            sort(answers.begin(), answers.end(),
-                    [&](pair<double, long> T1, pair<double, long> T2) {
-                    return (abs(T1.first - center) < abs(T2.first - center));
-                    });
+        // The separator from the last leaf is as short as can be
+        if (openNodes[0] == nullptr) {
+            openNode(0);
+            firstKeys[0] = lastLeaf == nullptr ? key : KeyFormat<Key>::separator(lastLeaf->keys.back(), key);
+            linkNode(0);
+        }
 
-            // Print the answers
-            pair <double, long> answer;
-            for (long i = 0; i < k && i < (long) answers.size(); ++i) {
-                answer = answers[i];
-#ifdef DEBUG_NORMAL
-                cout << answer.first << " ";
-#endif
-#ifdef OUTPUT
-                cout << DBObject(answer.first, answer.second).getDataString() << endl;
-#endif
+        Node *leaf = openNodes[0];
+        leaf->keys.push_back(key);
+        leaf->objectPointers.push_back(object.getFileIndex());
+        leaf->values.push_back(DBObject::isInline(object.getFileIndex()) ? object.getDataString() : string());
+    }
 
+    void BulkLoader::finish() {
+        // Finish the open nodes from the leaves up, the node left alone on
+        // the top level becomes the root
+        for (long level = 0; level < (long) openNodes.size(); ++level) {
+            if (level == (long) openNodes.size() - 1 && lastNodes[level] == DEFAULT_LOCATION) {
+                openNodes[level]->commitToDisk();
+                setRoot(openNodes[level]);
+                break;
             }
-        } else {
-            // We traverse the tree
-            long position = root->getKeyPosition(center);
+            finishNode(level);
+        }
+
+        if (lastLeaf != nullptr && lastLeaf != bRoot) {
+            bufferPool->release(lastLeaf);
+        }
+
+        // Even out the last node of every level with the one before it,
+        // going down the right edge of the tree
+        Node *node = bufferPool->fetch(rootIndex);
+        while (!node->isLeaf()) {
+            long last = node->childIndices.size() - 1;
+            Node *child = bufferPool->fetch(node->childIndices[last]);
+            bool underfull = child->underflows();
+            bufferPool->release(child);
+
+            if (underfull && last > 0) {
+                node->mergeChildren(last - 1);
+            }
+
+            Node *next = bufferPool->fetch(node->childIndices.back());
+            bufferPool->release(node);
+            node = next;
+        }
+        bufferPool->release(node);
 
-            // Load the node from disk
-            Node *nextRoot = new Node(root->childIndices[position]);
+        // Two children on the top level may have become one
+        shrinkRoot();
+    }
 
-            // Recurse into the node
-            kNNQuery(nextRoot, center, k);
+    // Bulk load an empty tree from unsorted key, dataString pairs
+    void bulkLoad(istream &input) {
+        long threads = thread::hardware_concurrency();
+        ExternalSorter sorter(getOption("sortRunSize", DEFAULT_SORT_RUN_SIZE),
+                getOption("sortThreads", threads > 0 ? threads : 1));
+        sorter.sort(input);
 
-            // Clean up
-            delete nextRoot;
+        if (sorter.size() == 0) {
+            return;
         }
+
+        // Store the objects in key order and pack them into leaves
+        BulkLoader loader(getOption("fillFactor", DEFAULT_FILL_FACTOR));
+        sorter.merge([&](BulkRecord &record) {
+                DBObject object(record.key, record.dataString);
+                loader.add(object);
+                });
+        loader.finish();
     }
 
+    // Take a checkpoint, the nodes and records are made durable and the log
+    // starts over from the session
     void storeSession() {
-        // Create a character buffer which will be written to disk
+        writeAheadLog->lockCheckpoint();
+
+        // Pages logged since the last checkpoint have to be durable before
+        // the nodes are written back
+        writeAheadLog->sync();
+        bufferPool->flush();
+        treeFile->sync();
+        objectStore->sync();
+
+        // Create a character buffer which will be written to the log
         long location = 0;
-        char buffer[Node::pageSize];
+        vector<long> freeFileIndices;
+        {
+            lock_guard<mutex> guard(Node::freeAccess);
+            freeFileIndices = Node::freeFileIndices;
+        }
+
+        // Snapshots do not outlive the run, after a restart the pages held
+        // for them are free
+        vector<long> heldPages = snapshotTable->heldPages();
+        freeFileIndices.insert(freeFileIndices.end(), heldPages.begin(), heldPages.end());
+        long freeCount = freeFileIndices.size();
+        vector<char> space((6 + freeCount) * sizeof(long));
+        char *buffer = space.data();
 
         // Store root's fileIndex
-        long fileIndex = bRoot->getFileIndex();
+        long fileIndex = rootIndex;
         memcpy(buffer + location, &fileIndex, sizeof(fileIndex));
         location += sizeof(fileIndex);
 
         // Store the fileCount
-        memcpy(buffer + location, &Node::fileCount, sizeof(Node::fileCount));
-        location += sizeof(Node::fileCount);
+        long fileCount = Node::fileCount;
+        memcpy(buffer + location, &fileCount, sizeof(fileCount));
+        location += sizeof(fileCount);
 
         // Store the objectCount for DBObject
-        memcpy(buffer + location, &DBObject::objectCount, sizeof(DBObject::objectCount));
-        location += sizeof(DBObject::objectCount);
+        long objectCount = DBObject::objectCount;
+        memcpy(buffer + location, &objectCount, sizeof(objectCount));
+        location += sizeof(objectCount);
 
-        // Create a binary file and write to memory
-        ofstream sessionFile;
-        sessionFile.open(SESSION_FILE, ios::binary|ios::out);
-        sessionFile.write(buffer, Node::pageSize);
-        sessionFile.close();
+        // Store the size of the object store
+        long objectSize = objectStore->size();
+        memcpy(buffer + location, &objectSize, sizeof(objectSize));
+        location += sizeof(objectSize);
+
+        // Store the free pages
+        memcpy(buffer + location, &freeCount, sizeof(freeCount));
+        location += sizeof(freeCount);
+        memcpy(buffer + location, freeFileIndices.data(), freeCount * sizeof(long));
+        location += freeCount * sizeof(long);
+
+        // Store the size of the value slots of the leaves
+        memcpy(buffer + location, &inlineValueSize, sizeof(inlineValueSize));
+        location += sizeof(inlineValueSize);
+
+        // Start the log over
+        writeAheadLog->restart(string(buffer, location), fileCount);
+        writeAheadLog->unlockCheckpoint();
     }
 
+    // Recover the tree of the last checkpoint from the log, and replay the
+    // inserts and removes logged after it
     void loadSession() {
-        // Create a character buffer which will be written to disk
-        long location = 0;
-        char buffer[Node::pageSize];
+        string session;
+        vector<LoggedChange> changes;
+        if (!writeAheadLog->recover(session, changes)) {
+            cout << "Unable to recover the tree from " << LOG_FILE;
+            exit(1);
+        }
 
-        // Open the binary file ane read into memory
-        ifstream sessionFile;
-        sessionFile.open(SESSION_FILE, ios::binary|ios::in);
-        sessionFile.read(buffer, Node::pageSize);
-        sessionFile.close();
+        long location = 0;
+        const char *buffer = session.data();
 
         // Retrieve the fileIndex
         long fileIndex;
@@ -985,13 +5019,56 @@ namespace BPlusTree {
         memcpy((char *) &objectCount, buffer + location, sizeof(objectCount));
         location += sizeof(objectCount);
 
-        // Store the session variables
+        // Retrieve the size of the object store
+        long objectSize;
+        memcpy((char *) &objectSize, buffer + location, sizeof(objectSize));
+        location += sizeof(objectSize);
+
+        // Retrieve the free pages
+        long freeCount;
+        memcpy((char *) &freeCount, buffer + location, sizeof(freeCount));
+        location += sizeof(freeCount);
+        Node::freeFileIndices.resize(freeCount);
+        memcpy((char *) Node::freeFileIndices.data(), buffer + location, freeCount * sizeof(long));
+        location += freeCount * sizeof(long);
+
+        // The leaves can only be read with the value slots they were built
+        // with, sessions from before inline values have none
+        long valueSize = 0;
+        if (location < (long) session.size()) {
+            memcpy((char *) &valueSize, buffer + location, sizeof(valueSize));
+            location += sizeof(valueSize);
+        }
+        if (valueSize != inlineValueSize) {
+            cout << "The tree was built with inlineValueSize " << valueSize;
+            exit(1);
+        }
+
+        // Store the session variables, records after the checkpoint are
+        // put back by the replay
         Node::fileCount = fileCount;
         DBObject::objectCount = objectCount;
+        objectStore->truncate(objectSize);
+
+        // Pin the root in the buffer pool
+        setRoot(bufferPool->fetch(fileIndex));
 
-        delete bRoot;
-        bRoot = new Node(fileIndex);
-        bRoot->readFromDisk();
+        // The changes are already in the log, they are replayed without
+        // being logged again and a checkpoint is taken once they are done
+        for (auto &change : changes) {
+            if (change.type == LOG_INSERT) {
+                if (!DBObject::isInline(change.objectPointer)) {
+                    objectStore->restore(change.objectPointer, change.dataString);
+                }
+                DBObject::objectCount++;
+                insertEntry(DBObject(change.key, change.objectPointer, change.dataString));
+            } else {
+                removeEntry(change.key, change.objectPointer);
+            }
+        }
+        if (!changes.empty()) {
+            storeSession();
+        }
     }
 }
 
@@ -1001,7 +5078,14 @@ void buildTree() {
     ifstream ifile;
     ifile.open("./assgn3_bplus_data.txt", ios::in);
 
-    double key;
+    // Build the tree bottom up unless asked to insert one by one
+    if (getOption("bulkLoad", 1)) {
+        bulkLoad(ifile);
+        ifile.close();
+        return;
+    }
+
+    Key key;
     string dataString;
     long count = 0;
     while (ifile >> key >> dataString) {
@@ -1012,7 +5096,7 @@ void buildTree() {
         }
 
         // Insert the object into file
-        insert(bRoot, DBObject(key, dataString));
+        insert(DBObject(key, dataString));
 
         // Update the counter
         count++;
@@ -1022,125 +5106,346 @@ void buildTree() {
     ifile.close();
 }
 
+// Read the arguments of a query
+Query readQuery(ifstream &ifile, long type) {
+    Query query;
+    query.type = type;
+
+    if (type == 0) {
+        ifile >> query.key >> query.dataString;
+    } else if (type == 1) {
+        ifile >> query.key;
+        query.lowerLimit = query.upperLimit = query.key;
+#ifndef STRING_KEYS
+    } else if (type == 2) {
+        // Same window as rangeQuery
+        ifile >> query.key >> query.range;
+        double range = query.range * 0.1;
+        query.upperLimit = KeyFormat<Key>::below(query.key + range);
+        query.lowerLimit = (query.key - range >= 0) ? KeyFormat<Key>::above(query.key - range) : 0;
+    } else if (type == 3) {
+        ifile >> query.key >> query.k;
+        query.lowerLimit = query.upperLimit = query.key;
+#endif
+    } else if (type == 4) {
+        ifile >> query.lowerLimit >> query.upperLimit;
+    } else if (type == 5) {
+        ifile >> query.key;
+    }
+
+    return query;
+}
+
+// Print the query as it was read
+void printQuery(Query &query, ostream &out) {
+    out << "\n" << query.type << " ";
+    if (query.type == 0) {
+        out << query.key << " " << query.dataString << "\n";
+    } else if (query.type == 1) {
+        out << query.key << "\n";
+    } else if (query.type == 2) {
+        out << query.key << " " << query.range << "\n";
+    } else if (query.type == 3) {
+        out << query.key << " " << query.k << "\n";
+    } else if (query.type == 4) {
+        out << query.lowerLimit << " " << query.upperLimit << "\n";
+    } else {
+        out << query.key << "\n";
+    }
+}
+
+// Part of the results which is printed and the bytes of them buffered
+// before they are written, set from the resultFields and outputBufferSize
+// options
+ResultFields printedFields = RESULT_RECORDS;
+long outputBufferSize = DEFAULT_OUTPUT_BUFFER_SIZE;
+
+// Read queries run on a snapshot taken as they start, set from the
+// snapshotReads option
+bool snapshotReads = false;
+
+// Return the nanoseconds since start
+long nanosecondsSince(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+// Answer a single query
+void answerQuery(Query &query, ostream &out) {
+    if (!timing) {
+        printQuery(query, out);
+    }
+
+    Cost before = printCosts ? counters.read() : Cost();
+    auto start = std::chrono::steady_clock::now();
+    bool read = query.type != 0 && query.type != 5;
+    unique_ptr<Snapshot> snapshot(snapshotReads && read ? new Snapshot() : nullptr);
+
+    // The results are dropped when timing
+    if (timing) {
+        ResultSink dropped;
+        executeQuery(query, dropped);
+        latencies[query.type].record(nanosecondsSince(start));
+        return;
+    }
+
+    StreamSink printed(out, printedFields, outputBufferSize);
+    executeQuery(query, printed);
+    printed.flush();
+
+    if (printCosts) {
+        out << "cost";
+        (counters.read() - before).print(out);
+        out << "\n";
+    }
+}
+
+// Answer the batched queries and print them in the order they were read
+void answerBatch(vector<Query> &batch, ostream &out) {
+    if (batch.empty()) {
+        return;
+    }
+
+    Cost before = printCosts ? counters.read() : Cost();
+    auto start = std::chrono::steady_clock::now();
+
+    // Individual queries cannot be timed, so each gets an equal share. The
+    // results are dropped.
+    if (timing) {
+        ResultSink dropped;
+        vector<ResultSink *> sinks(batch.size(), &dropped);
+        {
+            unique_ptr<Snapshot> snapshot(snapshotReads ? new Snapshot() : nullptr);
+            executeBatch(batch, sinks);
+        }
+
+        long share = nanosecondsSince(start) / batch.size();
+        for (auto &query : batch) {
+            latencies[query.type].record(share);
+        }
+        batch.clear();
+        return;
+    }
+
+    // The sweep finds the entries of the queries interleaved, each query
+    // writes them into its own buffer which is printed after the query
+    vector< unique_ptr<ostringstream> > outputs;
+    vector< unique_ptr<StreamSink> > printed;
+    vector<ResultSink *> sinks;
+    for (long i = 0; i < (long) batch.size(); ++i) {
+        outputs.emplace_back(new ostringstream());
+        outputs.back()->copyfmt(out);
+        printed.emplace_back(new StreamSink(*outputs.back(), printedFields, outputBufferSize));
+        sinks.push_back(printed.back().get());
+    }
+    {
+        unique_ptr<Snapshot> snapshot(snapshotReads ? new Snapshot() : nullptr);
+        executeBatch(batch, sinks);
+    }
+
+    for (long i = 0; i < (long) batch.size(); ++i) {
+        printQuery(batch[i], out);
+        printed[i]->flush();
+        out << outputs[i]->str();
+    }
+
+    // The queries of a batch share their cost, which includes reading the
+    // records of the results
+    if (printCosts) {
+        out << "batch cost";
+        (counters.read() - before).print(out);
+        out << "\n";
+    }
+
+    batch.clear();
+}
+
+// Print the latencies of each type of query in microseconds and the
+// throughput over seconds, as a table on out and as JSON into TIMING_FILE
+void reportTimings(double seconds, ostream &out) {
+    const char *names[QUERY_TYPES] = {"insert", "point", "range", "knn", "window", "remove"};
+    double fractions[] = {0.5, 0.9, 0.99, 0.999};
+    const char *percentiles[] = {"p50", "p90", "p99", "p999"};
+
+    long total = 0;
+    for (auto &histogram : latencies) {
+        total += histogram.size();
+    }
+    double throughput = seconds > 0 ? total / seconds : 0;
+
+    ofstream json(TIMING_FILE, ios::out | ios::trunc);
+    json << "{\"seconds\": " << seconds << ", \"queries\": " << total
+        << ", \"throughput\": " << throughput << ", \"latencies\": {";
+
+    out << "QUERY\tCOUNT\tMIN\tP50\tP90\tP99\tP999\tMAX\tAVG\tSTD" << endl;
+    bool first = true;
+    for (long type = 0; type < QUERY_TYPES; ++type) {
+        LatencyHistogram &histogram = latencies[type];
+        if (histogram.size() == 0) {
+            continue;
+        }
+
+        out << names[type] << "\t" << histogram.size() << "\t" << histogram.min() / 1e3;
+        json << (first ? "" : ", ") << "\"" << names[type] << "\": {\"count\": " << histogram.size()
+            << ", \"min\": " << histogram.min() / 1e3;
+        for (long i = 0; i < 4; ++i) {
+            out << "\t" << histogram.percentile(fractions[i]) / 1e3;
+            json << ", \"" << percentiles[i] << "\": " << histogram.percentile(fractions[i]) / 1e3;
+        }
+        out << "\t" << histogram.max() / 1e3 << "\t" << histogram.mean() / 1e3
+            << "\t" << histogram.deviation() / 1e3 << endl;
+        json << ", \"max\": " << histogram.max() / 1e3 << ", \"avg\": " << histogram.mean() / 1e3
+            << ", \"std\": " << histogram.deviation() / 1e3 << "}";
+        first = false;
+    }
+    json << "}";
+    if (printCosts) {
+        json << ", \"counters\": ";
+        ThreadCounters::total().printJson(json);
+    }
+    json << "}" << endl;
+
+    out << "Answered " << total << " queries in " << seconds << " s, "
+        << throughput << " queries per second" << endl;
+}
+
 void processQuery() {
     ifstream ifile;
     ifile.open("./assgn3_bplus_querysample.txt", ios::in);
+    auto start = std::chrono::steady_clock::now();
+
+    // Read queries can be collected and answered together
+    long batchSize = getOption("queryBatchSize", 1);
+    vector<Query> batch;
+
+    // With more than one thread, queries are handed to a pool of workers.
+    // Each query writes its output into its own buffer, which is printed
+    // once the queries before it are done.
+    long threads = getOption("threads", 1);
+    ThreadPool *pool = nullptr;
+    deque< pair< future<void>, shared_ptr<ostringstream> > > running;
+    if (threads > 1) {
+        bufferPool->flush();
+        concurrent = true;
+        pool = new ThreadPool(threads);
+    }
 
-    long query;
-    while (ifile >> query) {
-        if (query == 0) {
-            double key;
-            string dataString;
-            ifile >> key >> dataString;
+    auto printDone = [&](long maxRunning) {
+        while ((long) running.size() > maxRunning) {
+            running.front().first.wait();
+            cout << running.front().second->str();
+            running.pop_front();
+        }
+    };
 
-#ifdef OUTPUT
-            cout << endl << query << " " << key << " " << dataString << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // Insert into the database
-            insert(bRoot, DBObject(key, dataString));
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
-        } else if (query == 1) {
-            double key;
-            ifile >> key;
+    auto dispatch = [&](function<void(ostream &)> work) {
+        if (pool == nullptr) {
+            work(cout);
+            return;
+        }
 
-#ifdef OUTPUT
-            cout << endl << query << " " << key << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // pointQuery
-            pointQuery(bRoot, key);
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
-        } else if (query == 2) {
-            double key, range;
-            ifile >> key >> range;
+        auto output = make_shared<ostringstream>();
+        auto task = make_shared< packaged_task<void()> >([work, output]() { work(*output); });
+        running.push_back(make_pair(task->get_future(), output));
+        pool->submit([task]() { (*task)(); });
 
-#ifdef OUTPUT
-            cout << endl << query << " " << key << " " << range << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // rangeQuery
-            rangeQuery(bRoot, key, range * 0.1);
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
-        } else if (query == 3) {
-            double key;
-            long k;
-            ifile >> key >> k;
+        // Keep a few queries per thread in flight
+        printDone(4 * threads);
+    };
 
-#ifdef OUTPUT
-            cout << endl << query << " " << key << " " << k << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // kNNQuery
-            kNNQuery(bRoot, key, k);
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
-        } else if (query == 4) {
-            double lowerLimit;
-            double upperLimit;
-            ifile >> lowerLimit >> upperLimit;
+    auto flushBatch = [&]() {
+        if (!batch.empty()) {
+            auto queries = make_shared< vector<Query> >(std::move(batch));
+            batch.clear();
+            dispatch([queries](ostream &out) { answerBatch(*queries, out); });
+        }
+    };
 
-#ifdef OUTPUT
-            cout << endl << query << " " << lowerLimit << " " << upperLimit << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // windowQuery
-            windowQuery(bRoot, lowerLimit, upperLimit);
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
+    // Removed entries are taken out in batches, once no queries are in flight
+    long rebalanceInterval = getOption("rebalanceInterval", DEFAULT_REBALANCE_INTERVAL);
+
+    long type;
+    while (ifile >> type) {
+        // Unknown queries are skipped
+        if (type < 0 || type > 5) {
+            continue;
+        }
+#ifdef STRING_KEYS
+        // So are range and kNN queries, which need numeric keys
+        if (type == 2 || type == 3) {
+            string arguments;
+            getline(ifile, arguments);
+            continue;
+        }
 #endif
+        Query query = readQuery(ifile, type);
+
+        if (rebalanceInterval > 0 && pendingRemoves >= rebalanceInterval) {
+            flushBatch();
+            printDone(0);
+            rebalance();
         }
+
+        if (batchSize > 1 && type != 0 && type != 5) {
+            batch.push_back(query);
+            if ((long) batch.size() >= batchSize) {
+                flushBatch();
+            }
+            continue;
+        }
+
+        // Inserts and removes come after the queries before them
+        flushBatch();
+        dispatch([query](ostream &out) mutable { answerQuery(query, out); });
+    }
+
+    flushBatch();
+    printDone(0);
+
+    if (pool != nullptr) {
+        delete pool;
+        concurrent = false;
     }
 
     // Close the file
     ifile.close();
+
+    if (timing) {
+        reportTimings(nanosecondsSince(start) / 1e9, cout);
+    }
+
+    if (printCosts) {
+        cout << "Total cost";
+        ThreadCounters::total().print(cout);
+        cout << endl;
+        printTreeShape(cout);
+    }
 }
 
+#ifndef BPLUS_NO_MAIN
 int main() {
     // Initialize the BPlusTree module
     Node::initialize();
+    DBObject::initialize();
+    timing = getOption("timing", 0);
+    printCosts = getOption("counters", 0);
+    double fields = getOption("resultFields", RESULT_RECORDS);
+    if (fields != RESULT_RECORDS && fields != RESULT_KEYS && fields != RESULT_POINTERS) {
+        cout << "resultFields has to be 0, 1 or 2";
+        exit(1);
+    }
+    printedFields = (ResultFields) fields;
+    outputBufferSize = getOption("outputBufferSize", DEFAULT_OUTPUT_BUFFER_SIZE);
+    snapshotReads = getOption("snapshotReads", 0);
 
-    // Create a new tree
-    bRoot = new Node();
-
-    // Load session or build a new tree
-    ifstream sessionFile(SESSION_FILE);
-    if (sessionFile.good()) {
+    // Recover the tree from the log or build a new tree, which is logged
+    // from its first checkpoint on
+    if (writeAheadLog->exists()) {
         loadSession();
     } else {
+        setRoot(bufferPool->create());
         buildTree();
+        storeSession();
     }
 
     // Process queries
@@ -1149,5 +5454,12 @@ int main() {
     // Store the session
     storeSession();
 
+    // Write back the nodes and close the files
+    delete bufferPool;
+    delete treeFile;
+    delete objectStore;
+    delete writeAheadLog;
+
     return 0;
 }
+#endif